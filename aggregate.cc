@@ -0,0 +1,230 @@
+// aggregate.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "aggregate.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#include "hashring.h"
+
+#define MAX_KEY  255  // longer keys pass as they are
+
+using std::max;
+using std::min;
+
+namespace {
+
+inline int64_t GetTime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * (int64_t)1000000 + tv.tv_usec;
+}
+
+// the digits in [p, end), with a leading '-' if sign
+bool ParseInteger(const char *p, const char *end, bool sign,
+                  int64_t *value) {
+  bool negative = sign && p < end && *p == '-';
+  if (negative)
+    ++p;
+  if (p == end || end - p > 18)
+    return false;
+
+  int64_t n = 0;
+  for (; p < end; ++p) {
+    if (*p < '0' || *p > '9')
+      return false;
+    n = n * 10 + (*p - '0');
+  }
+  *value = negative ? -n : n;
+  return true;
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+Aggregator::Aggregator()
+    : interval_(0),
+      slots_(),
+      used_(0),
+      keys_(),
+      keys_used_(0),
+      out_(),
+      out_offset_(0),
+      flush_time_(0),
+      samples_(0),
+      lines_(0),
+      spills_(0) {
+  // empty
+}
+
+void Aggregator::Init(int interval, size_t series) {
+  interval_ = interval;
+
+  // half full at most, with 64 bytes of key a series on average
+  size_t n = 16;
+  while (n < series * 2)
+    n *= 2;
+  slots_.assign(n, Slot());
+  for (size_t i = 0; i < n; ++i)
+    slots_[i].hash = 0;
+  keys_.resize(max<size_t>(series * 64, MAX_KEY));
+}
+
+size_t Aggregator::Process(char *p, size_t n, size_t room) {
+  if (interval_ <= 0)
+    return n;
+
+  const char *end = p + n - 1;  // the '\n'
+  const char *value = static_cast<const char *>(memchr(p, ' ', end - p));
+  if (!value || value == p || value - p > MAX_KEY)
+    return n;
+  ++value;
+
+  const char *stamp = static_cast<const char *>(memchr(value, ' ',
+                                                       end - value));
+  int64_t t;
+  if (!stamp || stamp == value || !ParseInteger(stamp + 1, end, false, &t))
+    return n;
+
+  if (!Add(p, value - 1 - p, t - t % interval_, value, stamp - value))
+    return n;
+  return 0;
+}
+
+void Aggregator::DumpStats(FILE *fp) const {
+  fprintf(fp, "aggregate: samples %zu, lines %zu, spills %zu, series %zu\n",
+          samples_, lines_, spills_, used_);
+}
+
+int64_t Aggregator::Due() const {
+  if (out_offset_ < out_.size())
+    return 0;
+  if (used_ == 0)
+    return -1;
+
+  int64_t left = flush_time_ * (int64_t)1000000 - GetTime();
+  return left > 0 ? left : 0;
+}
+
+size_t Aggregator::Emit(char *buf, size_t n) {
+  if (out_offset_ == out_.size()) {
+    out_.clear();
+    out_offset_ = 0;
+    if (used_ > 0)
+      Spill();
+  }
+
+  // whole lines only
+  size_t left = out_.size() - out_offset_;
+  size_t m = min(n, left);
+  if (m < left)
+    while (m > 0 && out_[out_offset_ + m - 1] != '\n')
+      --m;
+
+  memcpy(buf, out_.data() + out_offset_, m);
+  out_offset_ += m;
+  return m;
+}
+
+bool Aggregator::Add(const char *key, size_t length, int64_t window,
+                     const char *value, size_t value_length) {
+  int64_t count = 0;
+  double sum = 0;
+  bool integral = ParseInteger(value, value + value_length, true, &count);
+  if (!integral) {
+    char s[64];
+    char *end;
+    if (value_length >= sizeof(s))
+      return false;
+    memcpy(s, value, value_length);
+    s[value_length] = 0;
+    sum = strtod(s, &end);
+    if (end != s + value_length || !isfinite(sum))
+      return false;
+  }
+
+  // the lines let out wait for two tables of them at most
+  if (out_.size() - out_offset_ > 2 * (keys_.size() + slots_.size() * 16))
+    return false;
+
+  uint64_t hash = (Hash(key, length) ^ (window * 0x9e3779b97f4a7c15ULL)) | 1;
+  size_t mask = slots_.size() - 1;
+  for (;;) {
+    size_t i = hash & mask;
+    for (; slots_[i].hash; i = (i + 1) & mask) {
+      Slot &slot = slots_[i];
+      if (slot.hash == hash && slot.window == window &&
+          slot.length == length &&
+          memcmp(&keys_[slot.key], key, length) == 0) {
+        slot.count += count;
+        slot.sum += sum;
+        slot.integral = slot.integral && integral;
+        ++samples_;
+        return true;
+      }
+    }
+
+    if ((used_ + 1) * 2 <= slots_.size() &&
+        keys_used_ + length <= keys_.size()) {
+      if (used_ == 0)
+        flush_time_ = (time(NULL) / interval_ + 1) * interval_;
+      Slot &slot = slots_[i];
+      slot.hash = hash;
+      slot.window = window;
+      slot.count = count;
+      slot.sum = sum;
+      slot.key = keys_used_;
+      slot.length = length;
+      slot.integral = integral;
+      memcpy(&keys_[keys_used_], key, length);
+      keys_used_ += length;
+      ++used_;
+      ++samples_;
+      return true;
+    }
+
+    // full, let out early and probe the empty table
+    ++spills_;
+    Spill();
+  }
+}
+
+void Aggregator::Spill() {
+  if (out_offset_ > 0) {
+    out_.erase(out_.begin(), out_.begin() + out_offset_);
+    out_offset_ = 0;
+  }
+
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    Slot &slot = slots_[i];
+    if (!slot.hash)
+      continue;
+
+    char line[MAX_KEY + 64];
+    int n;
+    if (slot.integral)
+      n = snprintf(line, sizeof(line), "%.*s %lld %lld\n",
+                   static_cast<int>(slot.length), &keys_[slot.key],
+                   static_cast<long long>(slot.count),
+                   static_cast<long long>(slot.window));
+    else
+      n = snprintf(line, sizeof(line), "%.*s %.15g %lld\n",
+                   static_cast<int>(slot.length), &keys_[slot.key],
+                   slot.sum + slot.count,
+                   static_cast<long long>(slot.window));
+    out_.insert(out_.end(), line, line + n);
+    ++lines_;
+    slot.hash = 0;
+  }
+
+  used_ = 0;
+  keys_used_ = 0;
+  flush_time_ = 0;
+}
+
+}  // namespace v
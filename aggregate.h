@@ -0,0 +1,70 @@
+// aggregate.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef AGGREGATE_H_
+#define AGGREGATE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "pipe.h"
+
+namespace v {
+
+// Rolls up the samples of counters, lines of "KEY VALUE TIMESTAMP" as of
+// Graphite, into one line per series and interval: the key, the sum of the
+// values and the start of the interval the timestamps fall in; the other
+// lines pass as they are. The lines are let out at the end of every
+// interval, by the clock, into the lane of the stages.
+//
+// The series are kept in an open addressing table of fixed size, probed
+// linearly, with the keys in an arena of their own. Once the table is half
+// full or the arena is, the series are let out before the interval ends,
+// so the memory is bounded; a sample of an interval let out already makes
+// one more line of it, which the backend sums as well. While the lines let
+// out wait for room in the pipe, the samples beyond that pass as they are.
+class Aggregator : public Stage {
+ public:
+  Aggregator();
+
+  // interval in seconds, series kept at most
+  void Init(int interval, size_t series);
+
+  size_t Process(char *p, size_t n, size_t room);
+  void DumpStats(FILE *fp) const;
+  int64_t Due() const;
+  size_t Emit(char *buf, size_t n);
+
+ private:
+  struct Slot {
+    uint64_t hash;   // of the key and the window, 0 if free
+    int64_t window;  // start of the interval
+    int64_t count;   // the sum of integer values
+    double sum;      // of the others
+    uint32_t key;    // offset in the arena
+    uint32_t length;
+    bool integral;
+  };
+
+  bool Add(const char *key, size_t length, int64_t window,
+           const char *value, size_t value_length);
+  void Spill();
+
+  int interval_;
+  vector<Slot> slots_;  // a power of 2 of them
+  size_t used_;
+  vector<char> keys_;   // the arena
+  size_t keys_used_;
+  vector<char> out_;    // lines let out, not yet emitted
+  size_t out_offset_;
+  time_t flush_time_;   // the end of the interval, if any series is held
+  size_t samples_;      // taken in
+  size_t lines_;        // let out
+  size_t spills_;       // times let out before the interval ended
+};
+
+}  // namespace v
+
+#endif  // AGGREGATE_H_
@@ -0,0 +1,295 @@
+// backfill.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "backfill.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <algorithm>
+
+#define CHECKPOINT_LINE  64  // bytes of each line of the checkpoint
+
+using std::max;
+using std::min;
+
+namespace {
+
+// line i + 1 of the checkpoint, the first one is the header
+bool SaveRange(int fd, int i, uint64_t start, uint64_t end, uint64_t done) {
+  char line[CHECKPOINT_LINE + 1];
+  snprintf(line, sizeof(line), "%020llu %020llu %020llu%*s\n",
+           (unsigned long long)start, (unsigned long long)end,
+           (unsigned long long)done, CHECKPOINT_LINE - 63, "");
+  return pwrite(fd, line, CHECKPOINT_LINE, (i + 1) * CHECKPOINT_LINE) >= 0;
+}
+
+// a range of the mapped file as the input of a job, keeping the checkpoint
+// of the range up to date with the acknowledgements
+class RangeSource : public v::Source {
+ public:
+  RangeSource(const char *map, uint64_t start, uint64_t end, uint64_t done,
+              int fd, int index)
+      : map_(map),
+        start_(start),
+        end_(end),
+        base_(done),
+        done_(done),
+        position_(done),
+        eof_(false),
+        failed_(false),
+        fd_(fd),
+        index_(index),
+        log_(NULL) {
+    // empty
+  }
+
+  bool Complete() const {
+    return done_ == end_;
+  }
+
+  int Descriptor() const {
+    return -1;
+  }
+
+  ssize_t Read(char *buf, size_t n) {
+    size_t m = min<uint64_t>(n, end_ - position_);
+    if (m == 0) {
+      eof_ = true;
+      return 0;
+    }
+    memcpy(buf, map_ + position_, m);
+    position_ += m;
+    return m;
+  }
+
+  bool Ready() const {
+    return !eof_;  // until the EOF is told
+  }
+
+  bool Lossless() const {
+    return true;
+  }
+
+  void Acknowledge(uint64_t offset, bool ok) {
+    // a range given up is taken again from there on the next run
+    if (!ok)
+      failed_ = true;
+    if (failed_)
+      return;
+    done_ = base_ + offset;
+    if (!SaveRange(fd_, index_, start_, end_, done_))
+      log_->Warn("%s: unable to save the checkpoint", __func__);
+  }
+
+  v::Log * SetLog(v::Log *p) {
+    v::Log *old = log_;
+    if (p)
+      log_ = p;
+    return old;
+  }
+
+ private:
+  const char *map_;
+  uint64_t start_;
+  uint64_t end_;
+  uint64_t base_;      // done when the job started
+  uint64_t done_;
+  uint64_t position_;  // read up to
+  bool eof_;
+  bool failed_;
+  int fd_;
+  int index_;
+  v::Log *log_;
+};
+
+}  // anonymous namespace
+
+namespace v {
+
+Backfill::Backfill()
+    : path_(NULL),
+      map_(NULL),
+      size_(0),
+      checkpoint_fd_(-1),
+      ranges_() {
+  // empty
+}
+
+Backfill::~Backfill() {
+  if (map_)
+    munmap(const_cast<char *>(map_), size_);
+  if (checkpoint_fd_ >= 0)
+    close(checkpoint_fd_);
+}
+
+bool Backfill::Open(const char *path, const char *checkpoint, int jobs) {
+  path_ = path;
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    warn("%s: unable to open %s", __func__, path);
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+
+  size_ = st.st_size;
+  if (size_ > 0) {
+    void *p = mmap(NULL, size_, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+      warn("%s: mmap(%s) error", __func__, path);
+      close(fd);
+      return false;
+    }
+    madvise(p, size_, MADV_SEQUENTIAL);
+    map_ = static_cast<const char *>(p);
+  }
+  close(fd);
+
+  checkpoint_fd_ = open(checkpoint, O_RDWR | O_CREAT, 0644);
+  if (checkpoint_fd_ < 0) {
+    warn("%s: unable to open %s", __func__, checkpoint);
+    return false;
+  }
+  if (Resume(st))
+    return true;
+
+  // each range ends with a record
+  jobs = max(jobs, 1);
+  uint64_t start = 0;
+  for (int i = 1; i <= jobs && start < size_; ++i) {
+    uint64_t end = i == jobs ? size_ : max<uint64_t>(size_ * i / jobs, start);
+    const char *eol = end < size_ ?
+        static_cast<const char *>(memchr(map_ + end, '\n', size_ - end)) :
+        NULL;
+    end = eol ? eol - map_ + 1 : size_;
+    Range range = { start, end, start };
+    ranges_.push_back(range);
+    start = end;
+  }
+
+  char header[CHECKPOINT_LINE + 1];
+  snprintf(header, sizeof(header), "backfill %020llu %020llu %05zu",
+           (unsigned long long)st.st_size, (unsigned long long)st.st_ino,
+           ranges_.size());
+  memset(header + strlen(header), ' ', sizeof(header) - strlen(header));
+  header[CHECKPOINT_LINE - 1] = '\n';
+  if (ftruncate(checkpoint_fd_, 0) < 0 ||
+      pwrite(checkpoint_fd_, header, CHECKPOINT_LINE, 0) < 0) {
+    warn("%s: unable to write %s", __func__, checkpoint);
+    return false;
+  }
+  for (size_t i = 0; i < ranges_.size(); ++i) {
+    if (!SaveRange(checkpoint_fd_, i, ranges_[i].start, ranges_[i].end,
+                   ranges_[i].done)) {
+      warn("%s: unable to write %s", __func__, checkpoint);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool Backfill::Run(HttpPipe *pipe, int rate, bool *stop) {
+  size_t left = 0;
+  for (size_t i = 0; i < ranges_.size(); ++i)
+    if (ranges_[i].done < ranges_[i].end)
+      ++left;
+  if (left == 0)
+    return true;
+
+  vector<pid_t> jobs;
+  for (size_t i = 0; i < ranges_.size(); ++i) {
+    const Range &r = ranges_[i];
+    if (r.done == r.end)
+      continue;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      warn("%s: fork() error", __func__);
+      break;
+    }
+    if (pid == 0) {
+      RangeSource source(map_, r.start, r.end, r.done, checkpoint_fd_, i);
+      pipe->SetSource(&source);
+      pipe->SetTransferRate(rate > 0 ? max<int>(rate / left, 1) : 0);
+      pipe->SetIdleTransfer(INT_MAX);
+      pipe->SetBusyTransfer(INT_MAX);
+      pipe->Serve(1);
+      _exit(source.Complete() ? 0 : 1);
+    }
+    jobs.push_back(pid);
+  }
+
+  bool ok = jobs.size() == left;
+  bool stopping = false;
+  for (size_t running = jobs.size(); running > 0; ) {
+    int status;
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid > 0) {
+      --running;
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        ok = false;
+    } else if (pid < 0 && errno != EINTR) {
+      warn("%s: waitpid() error", __func__);
+      return false;
+    } else {
+      if (stop && *stop && !stopping) {
+        for (size_t i = 0; i < jobs.size(); ++i)
+          kill(jobs[i], SIGTERM);
+        stopping = true;
+      }
+      usleep(100000);
+    }
+  }
+  return ok;
+}
+
+bool Backfill::Resume(const struct stat &st) {
+  char buf[CHECKPOINT_LINE * 2];
+  ssize_t n = pread(checkpoint_fd_, buf, CHECKPOINT_LINE, 0);
+  if (n <= 0)
+    return false;  // a new one
+
+  unsigned long long size, ino;
+  size_t count;
+  buf[n] = 0;
+  if (sscanf(buf, "backfill %llu %llu %zu", &size, &ino, &count) != 3 ||
+      size != (unsigned long long)st.st_size ||
+      ino != (unsigned long long)st.st_ino) {
+    warnx("%s: the checkpoint is not of %s, starting over", __func__, path_);
+    return false;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    unsigned long long start, end, done;
+    n = pread(checkpoint_fd_, buf, CHECKPOINT_LINE, (i + 1) * CHECKPOINT_LINE);
+    if (n <= 0)
+      break;
+    buf[n] = 0;
+    if (sscanf(buf, "%llu %llu %llu", &start, &end, &done) != 3 ||
+        start > done || done > end || end > size_)
+      break;
+    Range range = { start, end, done };
+    ranges_.push_back(range);
+  }
+  if (ranges_.size() != count) {
+    warnx("%s: the checkpoint of %s is broken, starting over", __func__,
+          path_);
+    ranges_.clear();
+    return false;
+  }
+  return true;
+}
+
+}  // namespace v
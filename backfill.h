@@ -0,0 +1,57 @@
+// backfill.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef BACKFILL_H_
+#define BACKFILL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pipe.h"
+
+namespace v {
+
+// Backfill uploads an existing file at once, as fast as the destinations
+// take it, rather than as an input trickling in.
+//
+// The file is mapped and cut at record boundaries into a range per job,
+// and each job is a pipe of its own, forked from a configured one, with
+// its own connection and its own compressor, so the jobs spread over the
+// cores; a job sends full batches back to back, whatever the transfer
+// interval and limits. The ranges and the bytes acknowledged in each are
+// kept in a checkpoint file, and an interrupted backfill run again resumes
+// where each range stopped.
+class Backfill {
+ public:
+  Backfill();
+  ~Backfill();
+
+  // jobs is the number of ranges, unless resumed from the checkpoint
+  bool Open(const char *path, const char *checkpoint, int jobs);
+
+  // forks a copy of the pipe per range left, sharing rate (bytes/s, 0 for
+  // no limit) among them, and waits for them, or stops them once *stop is
+  // set; true if the whole file is delivered
+  bool Run(HttpPipe *pipe, int rate, bool *stop);
+
+ private:
+  struct Range {
+    uint64_t start;
+    uint64_t end;
+    uint64_t done;  // acknowledged up to
+  };
+
+  bool Resume(const struct stat &st);
+
+  const char *path_;
+  const char *map_;
+  size_t size_;
+  int checkpoint_fd_;
+  vector<Range> ranges_;
+};
+
+}  // namespace v
+
+#endif  // BACKFILL_H_
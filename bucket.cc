@@ -0,0 +1,240 @@
+// bucket.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "bucket.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+
+#define BUCKET_MAGIC  0x7662756b65740001LL
+
+using std::max;
+using std::min;
+
+namespace {
+
+// the same for all processes of the host, unlike the wall clock it never
+// steps back
+inline int64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * (int64_t)1000000 + ts.tv_nsec / 1000;
+}
+
+inline bool Alive(int64_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+SharedBucket::SharedBucket()
+    : segment_(NULL),
+      slot_(NULL),
+      weight_(1),
+      min_share_(0),
+      share_(0),
+      share_time_(0),
+      window_start_(0),
+      window_bytes_(0) {
+  // empty
+}
+
+SharedBucket::~SharedBucket() {
+  if (slot_)
+    __sync_bool_compare_and_swap(&slot_->pid, (int64_t)getpid(), 0);
+  if (segment_)
+    munmap(segment_, sizeof(*segment_));
+}
+
+bool SharedBucket::Open(const char *name, int rate) {
+  char path[1024];
+  snprintf(path, sizeof(path), "/dev/shm/%s", name);
+
+  bool creator = true;
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0666);
+  if (fd < 0 && errno == EEXIST) {
+    creator = false;
+    fd = open(path, O_RDWR);
+  }
+  if (fd < 0) {
+    warn("%s: unable to open %s", __func__, path);
+    return false;
+  }
+
+  if (creator && ftruncate(fd, sizeof(Segment)) < 0) {
+    warn("%s: ftruncate(%s) error", __func__, path);
+    close(fd);
+    return false;
+  }
+
+  // the creator may not have sized it yet
+  struct stat st;
+  for (int i = 0; fstat(fd, &st) == 0 && st.st_size < (off_t)sizeof(Segment);
+       ++i) {
+    if (i == 1000) {
+      warnx("%s: %s is not a bucket", __func__, path);
+      close(fd);
+      return false;
+    }
+    usleep(1000);
+  }
+
+  void *p = mmap(NULL, sizeof(Segment), PROT_READ | PROT_WRITE, MAP_SHARED,
+                 fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    warn("%s: mmap(%s) error", __func__, path);
+    return false;
+  }
+  segment_ = static_cast<Segment *>(p);
+
+  if (creator) {
+    segment_->rate = rate;
+    segment_->tokens = 0;
+    segment_->stamp = Now();
+    __sync_synchronize();
+    segment_->magic = BUCKET_MAGIC;
+  } else {
+    for (int i = 0; segment_->magic != BUCKET_MAGIC; ++i) {
+      if (i == 1000) {
+        warnx("%s: %s is not a bucket", __func__, path);
+        munmap(segment_, sizeof(*segment_));
+        segment_ = NULL;
+        return false;
+      }
+      usleep(1000);
+    }
+    segment_->rate = rate;
+  }
+
+  // a free slot, or one left behind by a dead pipe
+  int64_t pid = getpid();
+  for (int i = 0; i < MAX_SLOTS && !slot_; ++i) {
+    Slot *slot = &segment_->slots[i];
+    int64_t owner = slot->pid;
+    if ((owner == 0 || !Alive(owner)) &&
+        __sync_bool_compare_and_swap(&slot->pid, owner, pid))
+      slot_ = slot;
+  }
+  if (!slot_) {
+    warnx("%s: no free slot in %s, %d pipes at most", __func__, path,
+          MAX_SLOTS);
+    munmap(segment_, sizeof(*segment_));
+    segment_ = NULL;
+    return false;
+  }
+
+  slot_->weight = weight_;
+  slot_->heartbeat = Now();
+  window_start_ = Now();
+  return true;
+}
+
+int SharedBucket::SetWeight(int n) {
+  int old = weight_;
+  if (n > 0) {
+    weight_ = n;
+    if (slot_)
+      slot_->weight = n;
+  }
+  return old;
+}
+
+int SharedBucket::SetMinShare(int n) {
+  int old = min_share_;
+  if (n >= 0)
+    min_share_ = n;
+  return old;
+}
+
+size_t SharedBucket::Take(size_t n, int64_t *wait) {
+  int64_t now = Now();
+  Refill(now);
+  UpdateShare(now);
+
+  if (now - window_start_ >= 1000000) {
+    window_start_ = now;
+    window_bytes_ = 0;
+  }
+
+  int64_t rate = max<int64_t>((int64_t)segment_->rate, 1);
+  int64_t floor = window_bytes_ < share_ ? 0 : rate / 2;
+  int64_t want = min<int64_t>(n, max<int64_t>(rate / 10, 1));
+
+  int64_t tokens;
+  int64_t granted;
+  do {
+    tokens = segment_->tokens;
+    granted = min(want, tokens - floor);
+    if (granted <= 0) {
+      // about when the bucket holds enough again
+      *wait = max<int64_t>((floor + want - tokens) * 1000000 / rate, 1000);
+      slot_->heartbeat = now;
+      return 0;
+    }
+  } while (!__sync_bool_compare_and_swap(&segment_->tokens, tokens,
+                                         tokens - granted));
+
+  slot_->heartbeat = now;
+  window_bytes_ += granted;
+  *wait = 0;
+  return granted;
+}
+
+void SharedBucket::Give(size_t n) {
+  if (n > 0) {
+    __sync_fetch_and_add(&segment_->tokens, (int64_t)n);
+    window_bytes_ -= min<int64_t>(n, window_bytes_);
+  }
+}
+
+void SharedBucket::Refill(int64_t now) {
+  // whoever moves the stamp adds the tokens of the time passed, the
+  // fraction of a token left is kept by moving it less
+  int64_t rate = max<int64_t>((int64_t)segment_->rate, 1);
+  int64_t stamp = segment_->stamp;
+  int64_t add = (now - stamp) * rate / 1000000;
+  if (add <= 0)
+    return;
+
+  int64_t to = now - stamp > 1000000 ? now : stamp + add * 1000000 / rate;
+  if (!__sync_bool_compare_and_swap(&segment_->stamp, stamp, to))
+    return;  // refilled by another pipe
+
+  // at most a second of tokens
+  int64_t tokens = __sync_add_and_fetch(&segment_->tokens, min(add, rate));
+  while (tokens > rate &&
+         !__sync_bool_compare_and_swap(&segment_->tokens, tokens, rate))
+    tokens = segment_->tokens;
+}
+
+void SharedBucket::UpdateShare(int64_t now) {
+  if (now - share_time_ < 100000)  // 100ms
+    return;
+
+  int64_t weights = 0;
+  for (int i = 0; i < MAX_SLOTS; ++i) {
+    const Slot &slot = segment_->slots[i];
+    if (&slot == slot_ ||
+        (slot.pid && now - slot.heartbeat < 2000000 && Alive(slot.pid)))
+      weights += slot.weight;
+  }
+
+  int64_t rate = segment_->rate;
+  share_ = max<int64_t>(rate * weight_ / max<int64_t>(weights, 1), min_share_);
+  share_time_ = now;
+}
+
+}  // namespace v
@@ -0,0 +1,72 @@
+// bucket.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef BUCKET_H_
+#define BUCKET_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pipe.h"
+
+namespace v {
+
+// SharedBucket is a token bucket in a file of /dev/shm, drawn by all the
+// pipes of a host with atomic operations, so their sum keeps to one rate
+// without a daemon in between.
+//
+// Each pipe holds a slot with its weight, a pipe is active while it draws,
+// and the rate is shared among the active ones by weight, but at least the
+// minimum share of each. The shares are kept loosely: the second half of
+// the bucket is reserved for the pipes below their share in the current
+// second, the others draw only the first half.
+class SharedBucket : public Limiter {
+ public:
+  SharedBucket();
+  ~SharedBucket();
+
+  // maps /dev/shm/NAME, created if missing; every pipe opening it sets the
+  // rate (bytes/s) of the host, the last one wins
+  bool Open(const char *name, int rate);
+
+  // Setting methods, as the ones of HttpPipe
+  int SetWeight(int n);
+  int SetMinShare(int n);  // bytes/s
+
+  size_t Take(size_t n, int64_t *wait);
+  void Give(size_t n);
+
+ private:
+  enum { MAX_SLOTS = 64 };
+
+  struct Slot {
+    volatile int64_t pid;
+    volatile int64_t weight;
+    volatile int64_t heartbeat;  // drawn at last, by the monotonic clock
+  };
+
+  struct Segment {
+    volatile int64_t magic;      // set once initialized
+    volatile int64_t rate;
+    volatile int64_t tokens;
+    volatile int64_t stamp;      // refilled up to
+    Slot slots[MAX_SLOTS];
+  };
+
+  void Refill(int64_t now);
+  void UpdateShare(int64_t now);
+
+  Segment *segment_;
+  Slot *slot_;
+  int weight_;
+  int min_share_;
+  int64_t share_;          // bytes/s
+  int64_t share_time_;     // computed at
+  int64_t window_start_;   // of the current second
+  int64_t window_bytes_;   // drawn in it
+};
+
+}  // namespace v
+
+#endif  // BUCKET_H_
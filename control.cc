@@ -0,0 +1,488 @@
+// control.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "control.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+enum { EPOLLIN = 0x001, EPOLLOUT = 0x004 };
+#endif
+#include <algorithm>
+
+namespace {
+
+enum Unit { UNIT_NUMBER, UNIT_SIZE, UNIT_RATE, UNIT_INTERVAL };
+
+struct Setting {
+  const char *name;
+  Unit unit;
+  int min;
+  int max;
+  int (v::HttpPipe::*set)(int n);
+};
+
+const Setting settings[] = {
+  {"rate", UNIT_RATE, 0, INT_MAX, &v::HttpPipe::SetTransferRate},
+  {"min-rate", UNIT_RATE, 0, INT_MAX, &v::HttpPipe::SetMinTransferRate},
+  {"express-rate", UNIT_RATE, 0, INT_MAX, &v::HttpPipe::SetExpressRate},
+  {"zip", UNIT_NUMBER, 0, 9, &v::HttpPipe::SetZipLevel},
+  {"max-zip", UNIT_NUMBER, 0, 9, &v::HttpPipe::SetMaxZipLevel},
+  {"interval", UNIT_INTERVAL, 1, INT_MAX, &v::HttpPipe::SetTransferInterval},
+  {"max-interval", UNIT_INTERVAL, 1, INT_MAX,
+   &v::HttpPipe::SetMaxTransferInterval},
+  {"idle-limit", UNIT_NUMBER, 0, INT_MAX, &v::HttpPipe::SetIdleTransfer},
+  {"busy-limit", UNIT_NUMBER, 0, INT_MAX, &v::HttpPipe::SetBusyTransfer},
+  {"buffer", UNIT_SIZE, 4096, INT_MAX, &v::HttpPipe::SetBufferSize},
+  {"retry", UNIT_NUMBER, 0, INT_MAX, &v::HttpPipe::SetConnectRetry},
+  {"max-lag", UNIT_NUMBER, 0, INT_MAX, &v::HttpPipe::SetMaxLag},
+  {"shed", UNIT_NUMBER, 0, 100, &v::HttpPipe::SetShedding},
+  {"idle-memory", UNIT_INTERVAL, 0, INT_MAX, &v::HttpPipe::SetIdleMemory},
+  {"verbose", UNIT_NUMBER, 0, INT_MAX, &v::HttpPipe::SetVerbose},
+};
+
+// as the options of the command line, but failing rather than exiting; a
+// rate is in bits a second, the value is in bytes then
+bool ParseValue(const char *s, Unit unit, long *value) {
+  errno = 0;
+  char *endptr;
+  long n = strtol(s, &endptr, 10);
+  if (errno || endptr == s || n < 0)
+    return false;
+
+  long k = 1;
+  switch (*endptr) {
+    case 0:
+      break;
+    case 'k':
+    case 'K':
+      k = unit == UNIT_SIZE ? 1024 : unit == UNIT_RATE ? 1000 : 0;
+      break;
+    case 'm':
+    case 'M':
+      k = unit == UNIT_SIZE ? 1048576 : unit == UNIT_RATE ? 1000000 :
+          unit == UNIT_INTERVAL ? 60 : 0;
+      break;
+    case 's':
+    case 'S':
+      k = unit == UNIT_INTERVAL ? 1 : 0;
+      break;
+    case 'h':
+    case 'H':
+      k = unit == UNIT_INTERVAL ? 3600 : 0;
+      break;
+    default:
+      k = 0;
+  }
+  if (!k || (*endptr && endptr[1]) || n > LONG_MAX / k)
+    return false;
+
+  *value = unit == UNIT_RATE ? n * k / 8 : n * k;
+  return true;
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+ControlSocket::ControlSocket()
+    : listen_fd_(-1),
+      epoll_fd_(-1),
+      path_(),
+      config_(NULL),
+      reload_flag_(NULL),
+      log_(NULL),
+#ifndef NO_VERBOSE
+      verbose_(0),
+#endif
+      clients_() {
+  // empty
+}
+
+ControlSocket::~ControlSocket() {
+  while (!clients_.empty())
+    Close(clients_.back());
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(path_);
+  }
+}
+
+const char * ControlSocket::SetConfig(const char *path) {
+  const char *old = config_;
+  if (path)
+    config_ = path;
+  return old;
+}
+
+bool * ControlSocket::SetReloadFlag(bool *p) {
+  bool *old = reload_flag_;
+  if (p)
+    reload_flag_ = p;
+  return old;
+}
+
+Log * ControlSocket::SetLog(Log *p) {
+  Log *old = log_;
+  if (p)
+    log_ = p;
+  return old;
+}
+
+int ControlSocket::SetVerbose(int n) {
+  int old = verbose_;
+#ifndef NO_VERBOSE
+  if (n >= 0)
+    verbose_ = n;
+#endif
+  return old;
+}
+
+int ControlSocket::Descriptor() const {
+  return epoll_fd_;
+}
+
+bool ControlSocket::Ready() const {
+  return reload_flag_ && *reload_flag_;
+}
+
+void ControlSocket::Run(HttpPipe *pipe) {
+  if (reload_flag_ && *reload_flag_) {
+    *reload_flag_ = false;
+    Load(pipe);
+  }
+  if (epoll_fd_ >= 0)
+    Dispatch(pipe);
+}
+
+bool ControlSocket::Execute(HttpPipe *pipe, char *line, FILE *fp) {
+  char *name = line + strspn(line, " \t");
+  char *end = name + strcspn(name, "\r\n");
+  while (end > name && (end[-1] == ' ' || end[-1] == '\t'))
+    --end;
+  *end = 0;
+  if (*name == 0 || *name == '#')
+    return true;
+
+  char *arg = name + strcspn(name, " \t");
+  if (*arg) {
+    *arg++ = 0;
+    arg += strspn(arg, " \t");
+  }
+
+  if (strcmp(name, "stats") == 0) {
+    pipe->DumpStats(fp);
+    fprintf(fp, "OK\n");
+    return true;
+  }
+
+  if (strcmp(name, "destination") == 0) {
+    // the links of the other modes are set up once and for all
+    const char *scheme = strstr(arg, "://");
+    if (!*arg || (scheme && (scheme - arg != 4 ||
+                             strncasecmp(arg, "http", 4) != 0))) {
+      fprintf(fp, "ERR an URL of http expect\n");
+      return false;
+    }
+    if (pipe->SetMode(-1) != HttpPipe::MODE_FAILOVER) {
+      fprintf(fp, "ERR destinations are added in failover mode only\n");
+      return false;
+    }
+    pipe->AddDestination(arg);
+    fprintf(fp, "OK\n");
+    return true;
+  }
+
+  const Setting *s = NULL;
+  for (size_t i = 0; i < sizeof(settings) / sizeof(*settings); ++i)
+    if (strcmp(name, settings[i].name) == 0)
+      s = &settings[i];
+  if (!s) {
+    fprintf(fp, "ERR unknown command: %s\n", name);
+    return false;
+  }
+
+  long value = -1;  // tells the setting only
+  if (*arg && (!ParseValue(arg, s->unit, &value) ||
+               value < s->min || value > s->max)) {
+    fprintf(fp, "ERR invalid %s: %s\n", name, arg);
+    return false;
+  }
+
+  // the buffers have to fit in the memory, as checked at start
+  size_t memory = pipe->SetMemoryLimit(-1);
+  if (s->set == &HttpPipe::SetBufferSize && value > 0 && memory &&
+      (size_t)value > memory / 4) {
+    fprintf(fp, "ERR too large %s: %s, 4 of them in %zu bytes\n", name, arg,
+            memory);
+    return false;
+  }
+
+  long old = (pipe->*s->set)(value);
+  fprintf(fp, "OK %ld\n", s->unit == UNIT_RATE ? old * 8 : old);
+  if (verbose_ && value >= 0)
+    log_->Info("* Control: %s %s, was %ld\n", name, arg,
+               s->unit == UNIT_RATE ? old * 8 : old);
+  return true;
+}
+
+void ControlSocket::Load(HttpPipe *pipe) {
+  if (!config_)
+    return;
+
+  FILE *fp = fopen(config_, "r");
+  if (!fp) {
+    log_->Warn("%s: unable to open %s", __func__, config_);
+    return;
+  }
+
+  char line[MAX_QUERY];
+  for (int lineno = 1; fgets(line, sizeof(line), fp); ++lineno) {
+    char *answer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&answer, &size);
+    if (!out) {
+      log_->Warn("%s: open_memstream() error", __func__);
+      break;
+    }
+    bool ok = Execute(pipe, line, out);
+    fclose(out);
+    if (!ok)
+      log_->Warnx("%s:%d: %.*s", config_, lineno,
+                  static_cast<int>(strcspn(answer, "\n")), answer);
+    free(answer);
+  }
+  fclose(fp);
+
+  if (verbose_)
+    log_->Info("* Control: loaded %s\n", config_);
+}
+
+#ifdef __linux__
+
+bool ControlSocket::Listen(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path) || strlen(path) >= sizeof(path_)) {
+    warnx("%s: path too long: %s", __func__, path);
+    return false;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) {
+    warn("%s: socket() error", __func__);
+    return false;
+  }
+
+  // the pipe is retuned by its owner only
+  unlink(path);  // left behind by a previous run
+  mode_t mask = umask(077);
+  bool bound = bind(s, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  umask(mask);
+  if (!bound || listen(s, 16) < 0) {
+    warn("%s: unable to listen at %s", __func__, path);
+    close(s);
+    return false;
+  }
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  listen_fd_ = s;
+  snprintf(path_, sizeof(path_), "%s", path);
+
+  if ((epoll_fd_ = epoll_create(16)) < 0) {
+    warn("%s: epoll_create() error", __func__);
+    return false;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // the listening socket
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) < 0) {
+    warn("%s: epoll_ctl() error", __func__);
+    return false;
+  }
+  return true;
+}
+
+void ControlSocket::Dispatch(HttpPipe *pipe) {
+  struct epoll_event events[16];
+  int n = epoll_wait(epoll_fd_, events, 16, 0);
+  if (n < 0 && errno != EINTR)
+    log_->Warn("%s: epoll_wait() error", __func__);
+
+  for (int i = 0; i < n; ++i) {
+    Client *c = static_cast<Client *>(events[i].data.ptr);
+    if (!c) {
+      Accept();
+      continue;
+    }
+
+    if ((events[i].events & EPOLLOUT) && !Send(c))
+      continue;  // closed
+    if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+      Receive(c, pipe);
+  }
+}
+
+void ControlSocket::Accept() {
+  int fd;
+  while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    Client *c = new Client;
+    c->fd = fd;
+    c->length = 0;
+    c->reply_offset = 0;
+    c->done = false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      log_->Warn("%s: epoll_ctl() error", __func__);
+      close(fd);
+      delete c;
+      continue;
+    }
+    clients_.push_back(c);
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    log_->Warn("%s: accept() error", __func__);
+}
+
+void ControlSocket::Watch(Client *c, int events) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    log_->Warn("%s: epoll_ctl() error", __func__);
+}
+
+void ControlSocket::Close(Client *c) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  clients_.erase(std::find(clients_.begin(), clients_.end(), c));
+  delete c;
+}
+
+#else  // no epoll
+
+bool ControlSocket::Listen(const char *path) {
+  warnx("%s: control socket is not supported on this platform", __func__);
+  return false;
+}
+
+void ControlSocket::Dispatch(HttpPipe *pipe) {
+  // empty
+}
+
+void ControlSocket::Accept() {
+  // empty
+}
+
+void ControlSocket::Watch(Client *c, int events) {
+  // empty
+}
+
+void ControlSocket::Close(Client *c) {
+  close(c->fd);
+  clients_.erase(std::find(clients_.begin(), clients_.end(), c));
+  delete c;
+}
+
+#endif  // __linux__
+
+bool ControlSocket::Receive(Client *c, HttpPipe *pipe) {
+  ssize_t n = read(c->fd, c->line + c->length,
+                   sizeof(c->line) - 1 - c->length);
+  if (n < 0 && (errno == EAGAIN || errno == EINTR))
+    return true;
+  if (n <= 0) {
+    // the answers still go out, e.g. to a client shutting its writing down
+    c->done = true;
+    if (c->reply_offset == c->reply.size()) {
+      Close(c);
+      return false;
+    }
+    Watch(c, EPOLLOUT);
+    return true;
+  }
+  c->length += n;
+  c->line[c->length] = 0;
+
+  char *answer = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream(&answer, &size);
+  if (!out) {
+    log_->Warn("%s: open_memstream() error", __func__);
+    Close(c);
+    return false;
+  }
+
+  // every whole line, the rest waits for its end
+  char *p = c->line;
+  char *eol;
+  while ((eol = strchr(p, '\n')) != NULL) {
+    *eol = 0;
+    Execute(pipe, p, out);
+    p = eol + 1;
+  }
+  c->length -= p - c->line;
+  memmove(c->line, p, c->length);
+  if (c->length == sizeof(c->line) - 1) {
+    fprintf(out, "ERR too long a line\n");
+    c->length = 0;
+  }
+
+  fclose(out);
+  c->reply.insert(c->reply.end(), answer, answer + size);
+  free(answer);
+  return Send(c);
+}
+
+bool ControlSocket::Send(Client *c) {
+  if (c->reply_offset < c->reply.size()) {
+    ssize_t n = write(c->fd, &c->reply[c->reply_offset],
+                      c->reply.size() - c->reply_offset);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      Close(c);
+      return false;
+    }
+    if (n > 0)
+      c->reply_offset += n;
+  }
+
+  if (c->reply_offset < c->reply.size()) {
+    Watch(c, c->done ? EPOLLOUT : EPOLLIN | EPOLLOUT);
+    return true;
+  }
+
+  c->reply.clear();
+  c->reply_offset = 0;
+  if (c->done) {
+    Close(c);
+    return false;
+  }
+  Watch(c, EPOLLIN);
+  return true;
+}
+
+}  // namespace v
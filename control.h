@@ -0,0 +1,89 @@
+// control.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <vector>
+
+#include "pipe.h"
+
+namespace v {
+
+using std::vector;
+
+// ControlSocket retunes a HttpPipe while it serves, by commands of a line
+// each, taken from the clients of a unix socket, and from a file whenever
+// asked to reload it, e.g. on SIGHUP. A command of a setting with a value
+// changes it and is answered with "OK" and the value it replaced, in the
+// units it is given, so sending that back undoes the change; without a
+// value the setting is only told; anything wrong is answered with "ERR"
+// and why. The commands are:
+//
+//   rate RATE, min-rate RATE, express-rate RATE   in bits, e.g. 800K
+//   zip LEVEL, max-zip LEVEL                      0~9
+//   interval INTERVAL, max-interval INTERVAL      e.g. 5m
+//   idle-limit N, busy-limit N                    transfers an interval
+//   buffer BUFSIZ                                 e.g. 4M
+//   retry N, max-lag N, shed PERCENT, idle-memory INTERVAL, verbose N
+//   destination URL                               added to the failover
+//   stats                                         the stats of the pipe
+class ControlSocket : public Control {
+ public:
+  ControlSocket();
+  ~ControlSocket();
+
+  bool Listen(const char *path);
+
+  // Setting methods, as the ones of HttpPipe:
+  //   the file of commands is run whenever the flag is set, which is
+  //   cleared then
+  const char * SetConfig(const char *path);
+  bool * SetReloadFlag(bool *p);
+  int SetVerbose(int n);
+
+  int Descriptor() const;
+  bool Ready() const;
+  void Run(HttpPipe *pipe);
+  Log * SetLog(Log *p);
+
+  // runs a command, its answer is written to fp, false if it fails
+  bool Execute(HttpPipe *pipe, char *line, FILE *fp);
+
+ private:
+  struct Client {
+    int fd;
+    char line[MAX_QUERY];
+    size_t length;
+    vector<char> reply;
+    size_t reply_offset;
+    bool done;  // nothing more to receive, closed once answered
+  };
+
+  void Load(HttpPipe *pipe);
+  void Dispatch(HttpPipe *pipe);
+  void Accept();
+  bool Receive(Client *c, HttpPipe *pipe);
+  bool Send(Client *c);
+  void Watch(Client *c, int events);
+  void Close(Client *c);
+
+  int listen_fd_;
+  int epoll_fd_;
+  char path_[108];  // of the socket, removed at last
+  const char *config_;
+  bool *reload_flag_;
+  Log *log_;
+#ifdef NO_VERBOSE
+  static const int verbose_ = 0;
+#else
+  int verbose_;
+#endif
+  vector<Client *> clients_;
+};
+
+}  // namespace v
+
+#endif  // CONTROL_H_
@@ -0,0 +1,237 @@
+// dedup.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "dedup.h"
+
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+
+#define MAX_RECORD  4096  // longer records pass as they are
+
+using std::max;
+using std::min;
+
+namespace {
+
+const uint64_t kPrime1 = 0x9e3779b185ebca87ULL;
+const uint64_t kPrime2 = 0xc2b2ae3d27d4eb4fULL;
+const uint64_t kPrime3 = 0x165667b19e3779f9ULL;
+const uint64_t kPrime4 = 0x85ebca77c2b2ae63ULL;
+const uint64_t kPrime5 = 0x27d4eb2f165667c5ULL;
+
+inline int64_t GetTime() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * (int64_t)1000000 + tv.tv_usec;
+}
+
+inline uint64_t Rotate(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+inline uint64_t Load(const char *p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+inline uint64_t Round(uint64_t h, uint64_t x) {
+  return Rotate(h + x * kPrime2, 31) * kPrime1;
+}
+
+// of xxHash64, the four lanes are independent of each other, so the words
+// of a block are mixed at once
+uint64_t HashRecord(const char *p, size_t n) {
+  const char *end = p + n;
+  uint64_t h;
+  if (n >= 32) {
+    uint64_t a = kPrime1 + kPrime2;
+    uint64_t b = kPrime2;
+    uint64_t c = 0;
+    uint64_t d = -kPrime1;
+    do {
+      a = Round(a, Load(p));
+      b = Round(b, Load(p + 8));
+      c = Round(c, Load(p + 16));
+      d = Round(d, Load(p + 24));
+      p += 32;
+    } while (p + 32 <= end);
+    h = Rotate(a, 1) + Rotate(b, 7) + Rotate(c, 12) + Rotate(d, 18);
+  } else {
+    h = kPrime5;
+  }
+
+  h += n;
+  for (; p + 8 <= end; p += 8)
+    h = Rotate(h ^ Round(0, Load(p)), 27) * kPrime1 + kPrime4;
+  for (; p < end; ++p)
+    h = Rotate(h ^ (static_cast<uint8_t>(*p) * kPrime5), 11) * kPrime1;
+
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
+  return h | 1;
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+Dedup::Dedup()
+    : interval_(0),
+      slots_(),
+      used_(0),
+      repeated_(0),
+      records_(),
+      records_used_(0),
+      out_(),
+      out_offset_(0),
+      flush_time_(0),
+      taken_(0),
+      repeats_(0),
+      lines_(0),
+      spills_(0) {
+  // empty
+}
+
+void Dedup::Init(int interval, size_t records) {
+  interval_ = interval;
+
+  // half full at most, with 128 bytes a record on average
+  size_t n = 16;
+  while (n < records * 2)
+    n *= 2;
+  slots_.assign(n, Slot());
+  for (size_t i = 0; i < n; ++i)
+    slots_[i].hash = 0;
+  records_.resize(max<size_t>(records * 128, MAX_RECORD));
+}
+
+size_t Dedup::Process(char *p, size_t n, size_t room) {
+  size_t length = n - 1;  // without the '\n'
+  if (interval_ <= 0 || length > MAX_RECORD)
+    return n;
+
+  ++taken_;
+  int64_t now = GetTime();
+  if (used_ > 0 && now >= flush_time_)
+    Spill();
+
+  // the records let out wait for two arenas of them at most
+  if (out_.size() - out_offset_ > 2 * records_.size())
+    return n;
+
+  uint64_t hash = HashRecord(p, length);
+  size_t mask = slots_.size() - 1;
+  size_t i = hash & mask;
+  for (; slots_[i].hash; i = (i + 1) & mask) {
+    Slot &slot = slots_[i];
+    if (slot.hash == hash && slot.length == length &&
+        memcmp(&records_[slot.offset], p, length) == 0) {
+      if (slot.repeats++ == 0)
+        ++repeated_;
+      slot.last = now;
+      ++repeats_;
+      return 0;
+    }
+  }
+
+  if ((used_ + 1) * 2 > slots_.size() ||
+      records_used_ + length > records_.size()) {
+    // full, let out early and take it into the empty table
+    ++spills_;
+    Spill();
+    i = hash & mask;
+  }
+
+  if (used_ == 0)
+    flush_time_ = now + interval_ * (int64_t)1000000;
+  Slot &slot = slots_[i];
+  slot.hash = hash;
+  slot.offset = records_used_;
+  slot.length = length;
+  slot.repeats = 0;
+  slot.first = now;
+  slot.last = now;
+  memcpy(&records_[records_used_], p, length);
+  records_used_ += length;
+  ++used_;
+  return n;
+}
+
+void Dedup::DumpStats(FILE *fp) const {
+  fprintf(fp, "dedup: records %zu, repeats %zu, lines %zu, spills %zu, "
+          "ratio %.2f\n", taken_, repeats_, lines_, spills_,
+          taken_ ? static_cast<double>(taken_) /
+                   (taken_ - repeats_ + lines_) : 1.0);
+}
+
+int64_t Dedup::Due() const {
+  if (out_offset_ < out_.size())
+    return 0;
+  if (repeated_ == 0)
+    return -1;
+
+  int64_t left = flush_time_ - GetTime();
+  return left > 0 ? left : 0;
+}
+
+size_t Dedup::Emit(char *buf, size_t n) {
+  if (out_offset_ == out_.size()) {
+    out_.clear();
+    out_offset_ = 0;
+    if (repeated_ > 0)
+      Spill();
+  }
+
+  // whole records only
+  size_t left = out_.size() - out_offset_;
+  size_t m = min(n, left);
+  if (m < left)
+    while (m > 0 && out_[out_offset_ + m - 1] != '\n')
+      --m;
+
+  memcpy(buf, out_.data() + out_offset_, m);
+  out_offset_ += m;
+  return m;
+}
+
+void Dedup::Spill() {
+  if (out_offset_ > 0) {
+    out_.erase(out_.begin(), out_.begin() + out_offset_);
+    out_offset_ = 0;
+  }
+
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    Slot &slot = slots_[i];
+    if (!slot.hash)
+      continue;
+
+    slot.hash = 0;
+    if (slot.repeats == 0)
+      continue;
+
+    char suffix[128];
+    int n = snprintf(suffix, sizeof(suffix),
+                     " [repeated %zu times, first %lld.%06d, last %lld.%06d]\n",
+                     slot.repeats,
+                     static_cast<long long>(slot.first / 1000000),
+                     static_cast<int>(slot.first % 1000000),
+                     static_cast<long long>(slot.last / 1000000),
+                     static_cast<int>(slot.last % 1000000));
+    const char *record = &records_[slot.offset];
+    out_.insert(out_.end(), record, record + slot.length);
+    out_.insert(out_.end(), suffix, suffix + n);
+    ++lines_;
+  }
+
+  used_ = 0;
+  repeated_ = 0;
+  records_used_ = 0;
+  flush_time_ = 0;
+}
+
+}  // namespace v
@@ -0,0 +1,68 @@
+// dedup.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef DEDUP_H_
+#define DEDUP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pipe.h"
+
+namespace v {
+
+// Collapses the records repeated as they are within an interval, e.g. of a
+// device in a loop of errors: the first one passes, the others are dropped
+// and counted, and at the end of the interval one more record is let out
+// into the lane of the stages for each record repeated, the record with
+// " [repeated N times, first T, last T]" before its '\n', N the ones
+// dropped and T the times it came in first and last, in seconds since the
+// epoch.
+//
+// The records are hashed 32 bytes at a time in four lanes, and kept in an
+// open addressing table of fixed size, probed linearly, with the records in
+// an arena of their own. Once the table is half full or the arena is, the
+// interval ends early, so the memory is bounded.
+class Dedup : public Stage {
+ public:
+  Dedup();
+
+  // interval in seconds, records kept at most
+  void Init(int interval, size_t records);
+
+  size_t Process(char *p, size_t n, size_t room);
+  void DumpStats(FILE *fp) const;
+  int64_t Due() const;
+  size_t Emit(char *buf, size_t n);
+
+ private:
+  struct Slot {
+    uint64_t hash;    // 0 if free
+    uint32_t offset;  // of the record in the arena
+    uint32_t length;  // without the '\n'
+    size_t repeats;   // dropped
+    int64_t first;    // microseconds since the epoch
+    int64_t last;
+  };
+
+  void Spill();
+
+  int interval_;
+  vector<Slot> slots_;     // a power of 2 of them
+  size_t used_;
+  size_t repeated_;        // of the slots used
+  vector<char> records_;   // the arena
+  size_t records_used_;
+  vector<char> out_;       // records let out, not yet emitted
+  size_t out_offset_;
+  int64_t flush_time_;     // the end of the interval, if any record is held
+  size_t taken_;           // records taken in
+  size_t repeats_;         // dropped
+  size_t lines_;           // let out
+  size_t spills_;          // times let out before the interval ended
+};
+
+}  // namespace v
+
+#endif  // DEDUP_H_
@@ -0,0 +1,265 @@
+// encode.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "encode.h"
+
+#include <string.h>
+
+#include "hashring.h"
+
+#define MAX_TIME  64  // bytes of a time at most
+
+using std::vector;
+
+namespace {
+
+void PutVarint(vector<char> *out, uint64_t n) {
+  while (n >= 0x80) {
+    out->push_back(static_cast<char>(n | 0x80));
+    n >>= 7;
+  }
+  out->push_back(static_cast<char>(n));
+}
+
+inline uint64_t ZigZag(int64_t n) {
+  return (static_cast<uint64_t>(n) << 1) ^ (n >> 63);
+}
+
+void Append(vector<char> *out, const vector<char> &v) {
+  out->insert(out->end(), v.begin(), v.end());
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+ColumnEncoder::ColumnEncoder()
+    : columns_(),
+      fields_(),
+      lengths_(),
+      times_(),
+      raw_(),
+      raw_records_(0),
+      last_raw_(0),
+      batches_(0),
+      records_(0),
+      unparsed_(0),
+      bytes_in_(0),
+      bytes_out_(0) {
+  // empty
+}
+
+bool ColumnEncoder::SetFormat(const char *format) {
+  columns_.clear();
+  const char *p = format;
+  while (*p) {
+    const char *end = strchr(p, ' ');
+    if (!end)
+      end = p + strlen(p);
+
+    Column column;
+    size_t n = end - p;
+    if (n == 4 && strncmp(p, "time", n) == 0)
+      column.kind = KIND_TIME;
+    else if (n == 4 && strncmp(p, "dict", n) == 0)
+      column.kind = KIND_DICT;
+    else if (n == 4 && strncmp(p, "text", n) == 0)
+      column.kind = KIND_TEXT;
+    else
+      return false;
+    column.last = 0;
+    columns_.push_back(column);
+
+    p = *end ? end + 1 : end;
+  }
+
+  fields_.resize(columns_.size());
+  lengths_.resize(columns_.size());
+  times_.resize(columns_.size());
+  return !columns_.empty();
+}
+
+bool ColumnEncoder::Encode(const char *p, size_t n, vector<char> *out) {
+  if (columns_.empty())
+    return false;
+
+  Reset();
+  const char *end = p + n;
+  size_t records = 0;
+  while (p < end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    size_t length = eol ? eol + 1 - p : end - p;
+    if (!eol || !Parse(p, length - 1)) {
+      PutVarint(&raw_, records - last_raw_);
+      PutVarint(&raw_, length);
+      raw_.insert(raw_.end(), p, p + length);
+      last_raw_ = records;
+      ++raw_records_;
+    }
+    ++records;
+    p += length;
+  }
+
+  out->insert(out->end(), "LCB1", "LCB1" + 4);
+  PutVarint(out, records);
+  PutVarint(out, columns_.size());
+  for (size_t i = 0; i < columns_.size(); ++i)
+    out->push_back("tdx"[columns_[i].kind]);
+  PutVarint(out, raw_records_);
+  Append(out, raw_);
+
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    Column &column = columns_[i];
+    vector<char> head;
+    if (column.kind == KIND_TIME) {
+      PutVarint(&head, column.bytes.size());
+      Append(&head, column.bytes);
+    } else if (column.kind == KIND_DICT) {
+      PutVarint(&head, column.values.size() / 2);
+      for (size_t k = 0; k < column.values.size(); k += 2) {
+        const char *value = column.bytes.data() + column.values[k];
+        PutVarint(&head, column.values[k + 1]);
+        head.insert(head.end(), value, value + column.values[k + 1]);
+      }
+    }
+
+    size_t rest = head.size() + column.data.size();
+    if (column.kind == KIND_TEXT)
+      rest += column.bytes.size();
+    PutVarint(out, rest);
+    Append(out, head);
+    Append(out, column.data);
+    if (column.kind == KIND_TEXT)
+      Append(out, column.bytes);
+  }
+
+  ++batches_;
+  records_ += records;
+  unparsed_ += raw_records_;
+  bytes_in_ += n;
+  bytes_out_ += out->size();
+  return true;
+}
+
+const char * ColumnEncoder::Name() const {
+  return "columns/1";
+}
+
+void ColumnEncoder::DumpStats(FILE *fp) const {
+  fprintf(fp, "encode: batches %zu, records %zu, unparsed %zu, bytes %zu, "
+          "encoded %zu\n", batches_, records_, unparsed_, bytes_in_,
+          bytes_out_);
+}
+
+bool ColumnEncoder::Parse(const char *p, size_t n) {
+  // every field is checked before any column takes one
+  const char *end = p + n;
+  size_t last = columns_.size() - 1;
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    const char *q = end;
+    if (i < last) {
+      q = static_cast<const char *>(memchr(p, ' ', end - p));
+      if (!q)
+        return false;
+    }
+
+    fields_[i] = p;
+    lengths_[i] = q - p;
+    if (columns_[i].kind == KIND_TIME &&
+        !ParseTime(&columns_[i], p, q - p, &times_[i]))
+      return false;
+    p = q + (i < last);
+  }
+
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    Column &column = columns_[i];
+    if (column.kind == KIND_TIME) {
+      PutVarint(&column.data, ZigZag(times_[i] - column.last));
+      column.last = times_[i];
+    } else if (column.kind == KIND_DICT) {
+      PutVarint(&column.data, Lookup(&column, fields_[i], lengths_[i]));
+    } else {
+      PutVarint(&column.data, lengths_[i]);
+      column.bytes.insert(column.bytes.end(), fields_[i],
+                          fields_[i] + lengths_[i]);
+    }
+  }
+  return true;
+}
+
+bool ColumnEncoder::ParseTime(Column *column, const char *p, size_t n,
+                              int64_t *value) {
+  if (n == 0 || n > MAX_TIME)
+    return false;
+
+  // the shape is taken from the first time of the batch
+  char shape[MAX_TIME];
+  int64_t number = 0;
+  size_t digits = 0;
+  for (size_t i = 0; i < n; ++i) {
+    if (p[i] >= '0' && p[i] <= '9') {
+      number = number * 10 + (p[i] - '0');
+      shape[i] = '0';
+      ++digits;
+    } else {
+      shape[i] = p[i];
+    }
+  }
+
+  if (digits == 0 || digits > 18)
+    return false;
+  if (column->bytes.empty())
+    column->bytes.assign(shape, shape + n);
+  else if (column->bytes.size() != n || memcmp(&column->bytes[0], shape, n))
+    return false;
+
+  *value = number;
+  return true;
+}
+
+size_t ColumnEncoder::Lookup(Column *column, const char *p, size_t n) {
+  vector<uint32_t> &table = column->table;
+  vector<uint32_t> &values = column->values;
+  if ((values.size() / 2 + 1) * 2 > table.size()) {
+    // half full at most, rehashed twice as large
+    table.assign(table.empty() ? 64 : table.size() * 2, 0);
+    size_t mask = table.size() - 1;
+    for (size_t k = 0; k < values.size(); k += 2) {
+      size_t i = Hash(column->bytes.data() + values[k], values[k + 1]) & mask;
+      while (table[i])
+        i = (i + 1) & mask;
+      table[i] = k / 2 + 1;
+    }
+  }
+
+  size_t mask = table.size() - 1;
+  size_t i = Hash(p, n) & mask;
+  for (; table[i]; i = (i + 1) & mask) {
+    size_t k = (table[i] - 1) * 2;
+    if (values[k + 1] == n &&
+        memcmp(column->bytes.data() + values[k], p, n) == 0)
+      return table[i] - 1;
+  }
+
+  table[i] = values.size() / 2 + 1;
+  values.push_back(column->bytes.size());
+  values.push_back(n);
+  column->bytes.insert(column->bytes.end(), p, p + n);
+  return table[i] - 1;
+}
+
+void ColumnEncoder::Reset() {
+  for (size_t i = 0; i < columns_.size(); ++i) {
+    Column &column = columns_[i];
+    column.data.clear();
+    column.bytes.clear();
+    column.last = 0;
+    column.table.assign(column.table.size(), 0);
+    column.values.clear();
+  }
+  raw_.clear();
+  raw_records_ = 0;
+  last_raw_ = 0;
+}
+
+}  // namespace v
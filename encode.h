@@ -0,0 +1,83 @@
+// encode.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef ENCODE_H_
+#define ENCODE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pipe.h"
+
+namespace v {
+
+// Encodes the records of a batch into columns, for the compressor to see
+// the alike values next to each other. A record is split by ' ' into the
+// columns of the format, the last one taking the rest of the record, and a
+// column is one of:
+//   time, digits and the punctuation between them, e.g. 1402000000.123 or
+//     2014-06-01T12:00:00, of the same shape all over the batch, coded as
+//     the number of the digits less the one of the record before;
+//   dict, a value of a few in a batch, e.g. a level, coded as the index of
+//     it in the values of the column;
+//   text, anything else, e.g. a message.
+// The records not of the format, e.g. without the '\n', are kept as they
+// are and in order.
+//
+// The batch is sent with "LETV-Encoding: columns/1", and is made of, the
+// numbers as unsigned LEB128 varints and the deltas zigzag coded first:
+//   "LCB1", the records, the columns, a byte for each column: 't', 'd' or
+//   'x';
+//   the records kept as they are, then each of them: its index less the
+//   one of the record kept before, if any, the length and the bytes;
+//   for each column the length of the rest of it, so a column not wanted
+//   is skipped, and
+//     time: the length and the shape, the digits as '0', then the deltas;
+//     dict: the values, each the length and the bytes, then the indexes;
+//     text: the lengths, then the bytes.
+class ColumnEncoder : public Encoder {
+ public:
+  ColumnEncoder();
+
+  // e.g. "time dict dict text", false if malformed
+  bool SetFormat(const char *format);
+
+  bool Encode(const char *p, size_t n, vector<char> *out);
+  const char * Name() const;
+  void DumpStats(FILE *fp) const;
+
+ private:
+  enum Kind { KIND_TIME, KIND_DICT, KIND_TEXT };
+
+  struct Column {
+    Kind kind;
+    vector<char> data;     // the deltas, indexes or lengths
+    vector<char> bytes;    // the shape, values or text
+    int64_t last;          // time, of the record before
+    vector<uint32_t> table;  // dict, the values by hash, 0 if free
+    vector<uint32_t> values;  // dict, an offset and a length in bytes each
+  };
+
+  bool Parse(const char *p, size_t n);
+  bool ParseTime(Column *column, const char *p, size_t n, int64_t *value);
+  size_t Lookup(Column *column, const char *p, size_t n);
+  void Reset();
+
+  vector<Column> columns_;
+  vector<const char *> fields_;  // of the record at hand
+  vector<size_t> lengths_;
+  vector<int64_t> times_;
+  vector<char> raw_;             // the records kept as they are
+  size_t raw_records_;
+  size_t last_raw_;
+  size_t batches_;
+  size_t records_;
+  size_t unparsed_;              // kept as they are
+  size_t bytes_in_;
+  size_t bytes_out_;
+};
+
+}  // namespace v
+
+#endif  // ENCODE_H_
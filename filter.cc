@@ -0,0 +1,248 @@
+// filter.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "filter.h"
+
+#include <string.h>
+#ifdef FILTER_SSSE3
+#include <tmmintrin.h>
+#endif
+#include <algorithm>
+#include <utility>
+
+using std::min;
+using std::pair;
+
+namespace v {
+
+Filter::Filter()
+    : patterns_(),
+      anchored_(),
+      compiled_(false),
+      keeping_(false),
+      dropping_(false),
+      width_(0),
+      ssse3_(false) {
+  memset(lo_, 0, sizeof(lo_));
+  memset(hi_, 0, sizeof(hi_));
+}
+
+void Filter::AddPattern(const char *pattern, bool keep) {
+  Pattern p;
+  p.text = pattern;
+  p.length = strlen(pattern);
+  p.anchor = ANCHOR_NONE;
+  p.keep = keep;
+  p.hits = 0;
+
+  if (*pattern == '^') {
+    p.anchor = ANCHOR_START;
+    ++p.text;
+    --p.length;
+  } else if (p.length > 0 && pattern[p.length - 1] == '$') {
+    p.anchor = ANCHOR_END;
+    --p.length;
+  }
+
+  if (p.length == 0)
+    return;
+  patterns_.push_back(p);
+  compiled_ = false;
+}
+
+size_t Filter::Hits(size_t i) const {
+  return i < patterns_.size() ? patterns_[i].hits : 0;
+}
+
+size_t Filter::Process(char *p, size_t n, size_t room) {
+  if (!compiled_)
+    Compile();
+
+  int i = Search(p, n - 1);  // without the '\n'
+  if (i >= 0)
+    ++patterns_[i].hits;
+  return (i >= 0 ? !patterns_[i].keep : keeping_) ? 0 : n;
+}
+
+void Filter::DumpStats(FILE *fp) const {
+  for (size_t i = 0; i < patterns_.size(); ++i) {
+    const Pattern &p = patterns_[i];
+    fprintf(fp, "filter %zu (%s%.*s%s): %s, hits %zu\n", i,
+            p.anchor == ANCHOR_START ? "^" : "",
+            static_cast<int>(p.length), p.text,
+            p.anchor == ANCHOR_END ? "$" : "",
+            p.keep ? "keep" : "drop", p.hits);
+  }
+}
+
+void Filter::Compile() {
+  vector<pair<uint32_t, int> > anywhere;  // by the bytes in the masks
+  anchored_.clear();
+  keeping_ = false;
+  dropping_ = false;
+  width_ = 3;
+  for (size_t i = 0; i < patterns_.size(); ++i) {
+    const Pattern &p = patterns_[i];
+    keeping_ = keeping_ || p.keep;
+    if (p.anchor != ANCHOR_NONE) {
+      anchored_.push_back(i);
+    } else {
+      anywhere.push_back(pair<uint32_t, int>(0, i));
+      dropping_ = dropping_ || !p.keep;
+      width_ = min(width_, p.length);
+    }
+  }
+
+  if (anywhere.empty())
+    width_ = 0;
+
+  // the patterns alike share a bucket, so a bucket hit is less often a
+  // false one
+  for (size_t i = 0; i < anywhere.size(); ++i)
+    for (size_t k = 0; k < width_; ++k)
+      anywhere[i].first |= static_cast<uint8_t>(
+          patterns_[anywhere[i].second].text[k]) << (16 - 8 * k);
+  std::sort(anywhere.begin(), anywhere.end());
+
+  memset(lo_, 0, sizeof(lo_));
+  memset(hi_, 0, sizeof(hi_));
+  for (size_t b = 0; b < 8; ++b)
+    buckets_[b].clear();
+  for (size_t i = 0; i < anywhere.size(); ++i) {
+    size_t b = i * 8 / anywhere.size();
+    const Pattern &p = patterns_[anywhere[i].second];
+    buckets_[b].push_back(anywhere[i].second);
+    for (size_t k = 0; k < width_; ++k) {
+      uint8_t c = p.text[k];
+      lo_[k][c & 15] |= 1 << b;
+      hi_[k][c >> 4] |= 1 << b;
+    }
+  }
+
+#ifdef FILTER_SSSE3
+  ssse3_ = __builtin_cpu_supports("ssse3");
+#endif
+  compiled_ = true;
+}
+
+int Filter::Search(const char *p, size_t n) const {
+  int found = -1;
+  for (size_t i = 0; i < anchored_.size(); ++i) {
+    const Pattern &pattern = patterns_[anchored_[i]];
+    if (pattern.length > n || (pattern.keep && found >= 0))
+      continue;
+
+    const char *s = pattern.anchor == ANCHOR_START ? p :
+                    p + n - pattern.length;
+    if (memcmp(s, pattern.text, pattern.length) == 0) {
+      if (!pattern.keep)
+        return anchored_[i];
+      found = anchored_[i];
+    }
+  }
+
+  if (width_ == 0 || n < width_ || (found >= 0 && !dropping_))
+    return found;
+#ifdef FILTER_SSSE3
+  if (ssse3_)
+    return SearchSsse3(p, n, found);
+#endif
+  return SearchScalar(p, n, found);
+}
+
+int Filter::SearchScalar(const char *p, size_t n, int found) const {
+  for (size_t j = 0; j + width_ <= n; ++j) {
+    unsigned buckets = 0xff;
+    for (size_t k = 0; k < width_ && buckets; ++k) {
+      uint8_t c = p[j + k];
+      buckets &= lo_[k][c & 15] & hi_[k][c >> 4];
+    }
+    if (buckets && Verify(p, n, j, buckets, &found))
+      break;
+  }
+  return found;
+}
+
+#ifdef FILTER_SSSE3
+__attribute__((target("ssse3")))
+int Filter::SearchSsse3(const char *p, size_t n, int found) const {
+  const __m128i low = _mm_set1_epi8(0x0f);
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo[3];
+  __m128i hi[3];
+  for (size_t k = 0; k < width_; ++k) {
+    lo[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo_[k]));
+    hi[k] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi_[k]));
+  }
+
+  // not to read beyond the record, the last block overlaps the one before
+  // with the positions tried masked off, or is a copy if there is no one
+  char tail[16 + 2];
+  size_t last = n - width_ + 1;  // positions to try
+  for (size_t i = 0; i < last; i += 16) {
+    const char *s = p + i;
+    unsigned valid = 0xffff;
+    if (i + 16 > last) {
+      if (last >= 16) {
+        valid = (0xffff << (16 - (last - i))) & 0xffff;
+        i = last - 16;
+        s = p + i;
+      } else {
+        memset(tail, 0, sizeof(tail));
+        memcpy(tail, s, n - i);
+        s = tail;
+        valid = (1u << (last - i)) - 1;
+      }
+    }
+
+    __m128i hit = _mm_set1_epi8(-1);
+    for (size_t k = 0; k < width_; ++k) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + k));
+      __m128i l = _mm_shuffle_epi8(lo[k], _mm_and_si128(v, low));
+      __m128i h = _mm_shuffle_epi8(hi[k],
+                                   _mm_and_si128(_mm_srli_epi16(v, 4), low));
+      hit = _mm_and_si128(hit, _mm_and_si128(l, h));
+    }
+
+    unsigned positions = ~_mm_movemask_epi8(_mm_cmpeq_epi8(hit, zero)) &
+                         valid;
+    if (!positions)
+      continue;
+
+    uint8_t buckets[16];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(buckets), hit);
+    do {
+      size_t j = __builtin_ctz(positions);
+      if (Verify(p, n, i + j, buckets[j], &found))
+        return found;
+      positions &= positions - 1;
+    } while (positions);
+  }
+  return found;
+}
+#endif
+
+bool Filter::Verify(const char *p, size_t n, size_t j, unsigned buckets,
+                    int *found) const {
+  for (size_t b = 0; b < 8; ++b) {
+    if (!(buckets & (1 << b)))
+      continue;
+
+    for (size_t i = 0; i < buckets_[b].size(); ++i) {
+      int k = buckets_[b][i];
+      const Pattern &pattern = patterns_[k];
+      if ((pattern.keep && *found >= 0) || j + pattern.length > n ||
+          memcmp(p + j, pattern.text, pattern.length) != 0)
+        continue;
+
+      // a drop pattern decides at once, a keep one unless a drop one may
+      // be found further
+      *found = k;
+      if (!pattern.keep || !dropping_)
+        return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace v
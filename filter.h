@@ -0,0 +1,78 @@
+// filter.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pipe.h"
+
+// compiled for SSSE3 apart, and used where the CPU has it
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define FILTER_SSSE3
+#endif
+
+namespace v {
+
+// Drops the records with a drop pattern in them and, once there are keep
+// patterns, the ones without a keep pattern, before they are batched and
+// compressed.
+//
+// A pattern is a literal, found at the start of a record if given as
+// "^PREFIX", at its end, before the '\n', as "SUFFIX$", or anywhere in it
+// otherwise. The ones found anywhere are searched all at once: up to their
+// first 3 bytes are put into 8 buckets of nibble masks, 16 positions of a
+// record are tried against all of the buckets with a few shuffles where
+// SSSE3 is available, or one position at a time otherwise, and only the
+// patterns of the buckets hit are compared. A record is decided by the
+// first drop pattern found, else by a keep pattern found, and the pattern
+// deciding it counts a hit.
+class Filter : public Stage {
+ public:
+  Filter();
+
+  // the pattern is kept by reference, as an argument of the command line
+  void AddPattern(const char *pattern, bool keep);
+  size_t Hits(size_t i) const;  // of the patterns, in the order added
+
+  size_t Process(char *p, size_t n, size_t room);
+  void DumpStats(FILE *fp) const;
+
+ private:
+  enum Anchor { ANCHOR_NONE, ANCHOR_START, ANCHOR_END };
+
+  struct Pattern {
+    const char *text;
+    size_t length;
+    Anchor anchor;
+    bool keep;
+    size_t hits;
+  };
+
+  void Compile();
+  int Search(const char *p, size_t n) const;
+  int SearchScalar(const char *p, size_t n, int found) const;
+#ifdef FILTER_SSSE3
+  int SearchSsse3(const char *p, size_t n, int found) const;
+#endif
+  bool Verify(const char *p, size_t n, size_t j, unsigned buckets,
+              int *found) const;
+
+  vector<Pattern> patterns_;
+  vector<int> anchored_;
+  vector<int> buckets_[8];  // of the patterns found anywhere
+  bool compiled_;
+  bool keeping_;            // there are keep patterns
+  bool dropping_;           // there are drop patterns found anywhere
+  size_t width_;            // bytes of a pattern in the masks
+  uint8_t lo_[3][16];       // buckets by the low nibble of byte k
+  uint8_t hi_[3][16];       // by the high nibble
+  bool ssse3_;
+};
+
+}  // namespace v
+
+#endif  // FILTER_H_
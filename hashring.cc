@@ -0,0 +1,68 @@
+// hashring.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "hashring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+namespace v {
+
+uint64_t Hash(const void *data, size_t n) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < n; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+HashRing::HashRing(int replicas)
+    : replicas_(replicas),
+      points_() {
+  // empty
+}
+
+void HashRing::Add(int node, const char *name) {
+  char buf[1200];
+  for (int i = 0; i < replicas_; ++i) {
+    int n = snprintf(buf, sizeof(buf), "%s#%d", name, i);
+    points_.push_back(Point(Hash(buf, n), node));
+  }
+  std::sort(points_.begin(), points_.end());
+}
+
+void HashRing::Remove(int node) {
+  vector<Point>::iterator it = points_.begin();
+  while (it != points_.end()) {
+    if (it->second == node)
+      it = points_.erase(it);
+    else
+      ++it;
+  }
+}
+
+int HashRing::Lookup(const void *key, size_t n) const {
+  if (points_.empty())
+    return -1;
+
+  vector<Point>::const_iterator it =
+      std::lower_bound(points_.begin(), points_.end(), Point(Hash(key, n), 0));
+  if (it == points_.end())  // wrap around
+    it = points_.begin();
+  return it->second;
+}
+
+bool HashRing::Empty() const {
+  return points_.empty();
+}
+
+}  // namespace v
@@ -0,0 +1,41 @@
+// hashring.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef HASHRING_H_
+#define HASHRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+namespace v {
+
+using std::pair;
+using std::vector;
+
+// 64-bit FNV-1a with a final avalanche, cheap and well spread
+uint64_t Hash(const void *data, size_t n);
+
+// Consistent hashing: every node owns a number of virtual points on a ring,
+// a key belongs to the first point at or after its own hash. Adding or
+// removing a node only moves the keys around its points.
+class HashRing {
+ public:
+  explicit HashRing(int replicas = 128);
+
+  void Add(int node, const char *name);
+  void Remove(int node);
+  int Lookup(const void *key, size_t n) const;  // -1 if empty
+  bool Empty() const;
+
+ private:
+  typedef pair<uint64_t, int> Point;
+
+  int replicas_;
+  vector<Point> points_;  // sorted by hash
+};
+
+}  // namespace v
+
+#endif  // HASHRING_H_
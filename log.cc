@@ -0,0 +1,218 @@
+// log.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "log.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+
+#define MAX_MESSAGE  4096  // longer ones are cut
+
+using std::min;
+
+namespace {
+
+const char * ProgramName() {
+#ifdef __GLIBC__
+  return program_invocation_short_name;
+#else
+  return getprogname();
+#endif
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+Log::Log()
+    : rate_(100),
+      messages_(0),
+      drops_(0),
+      suppressions_(0) {
+  int fds[LEVELS] = { STDOUT_FILENO, STDERR_FILENO };
+  FILE *fps[LEVELS] = { stdout, stderr };
+  for (int i = 0; i < LEVELS; ++i) {
+    Output *out = &outputs_[i];
+    struct stat st;
+    out->fd = fds[i];
+    out->fp = fps[i];
+    out->regular = fstat(out->fd, &st) == 0 && S_ISREG(st.st_mode);
+    out->head = 0;
+    out->length = 0;
+    out->window = 0;
+    out->count = 0;
+    out->suppressed = 0;
+    out->dropped = 0;
+  }
+  Init(65536);
+}
+
+Log::~Log() {
+  Flush();
+}
+
+void Log::Init(size_t size) {
+  Flush();
+  for (int i = 0; i < LEVELS; ++i)
+    std::vector<char>(size).swap(outputs_[i].ring);
+}
+
+int Log::SetRate(int n) {
+  int old = rate_;
+  if (n >= 0)
+    rate_ = n;
+  return old;
+}
+
+void Log::Info(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  Write(LEVEL_INFO, false, format, ap);
+  va_end(ap);
+}
+
+void Log::Warnx(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  Write(LEVEL_WARNING, false, format, ap);
+  va_end(ap);
+}
+
+void Log::Warn(const char *format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  Write(LEVEL_WARNING, true, format, ap);
+  va_end(ap);
+}
+
+void Log::Watch(struct pollfd *pfds) const {
+  for (int i = 0; i < LEVELS; ++i) {
+    pfds[i].fd = outputs_[i].length > 0 ? outputs_[i].fd : -1;
+    pfds[i].events = POLLOUT;
+  }
+}
+
+void Log::Drain(const struct pollfd *pfds) {
+  for (int i = 0; i < LEVELS; ++i) {
+    Output *out = &outputs_[i];
+    if (pfds[i].fd < 0 || !(pfds[i].revents & (POLLOUT | POLLERR)))
+      continue;
+
+    // a pipe or a terminal found writable takes PIPE_BUF bytes at least
+    // without blocking, a file takes anything
+    Send(out, out->regular ? out->length : PIPE_BUF);
+  }
+}
+
+void Log::Flush() {
+  // an output taking nothing for a second is given up, rather than held
+  // on to forever
+  for (int i = 0; i < LEVELS; ++i) {
+    Output *out = &outputs_[i];
+    while (out->length > 0) {
+      struct pollfd pfd;
+      pfd.fd = out->fd;
+      pfd.events = POLLOUT;
+      int res = poll(&pfd, 1, 1000);
+      if (res < 0 && errno == EINTR)
+        continue;
+      if (res <= 0) {
+        out->head = out->length = 0;
+        break;
+      }
+      Send(out, out->regular ? out->length : PIPE_BUF);
+    }
+  }
+}
+
+void Log::DumpStats(FILE *fp) const {
+  fprintf(fp, "log: messages %zu, drops %zu, suppressions %zu\n",
+          messages_, drops_, suppressions_);
+}
+
+void Log::Write(Level level, bool error, const char *format, va_list ap) {
+  Output *out = &outputs_[level];
+  int saved_errno = errno;
+
+  time_t now = time(NULL);
+  if (now != out->window) {
+    out->window = now;
+    out->count = 0;
+  }
+  if (rate_ > 0 && out->count >= (size_t)rate_) {
+    ++out->suppressed;
+    ++suppressions_;
+    return;
+  }
+  ++out->count;
+
+  // what was lost is told first, once there is room for it
+  char line[MAX_MESSAGE];
+  int n;
+  if (out->dropped > 0 || out->suppressed > 0) {
+    n = snprintf(line, sizeof(line), "%s: %zu messages dropped, %zu "
+                 "suppressed\n", ProgramName(), out->dropped,
+                 out->suppressed);
+    if (!Append(out, line, n)) {
+      ++out->dropped;
+      ++drops_;
+      return;
+    }
+    out->dropped = 0;
+    out->suppressed = 0;
+  }
+
+  n = 0;
+  if (level == LEVEL_WARNING)
+    n = snprintf(line, sizeof(line), "%s: ", ProgramName());
+  n += vsnprintf(line + n, sizeof(line) - n, format, ap);
+  n = min<int>(n, sizeof(line) - 1);
+  if (error)
+    n += snprintf(line + n, sizeof(line) - n, ": %s", strerror(saved_errno));
+  n = min<int>(n, sizeof(line) - 2);
+  if (level == LEVEL_WARNING)
+    line[n++] = '\n';
+
+  if (!Append(out, line, n)) {
+    ++out->dropped;
+    ++drops_;
+    return;
+  }
+  ++messages_;
+}
+
+bool Log::Append(Output *out, const char *p, size_t n) {
+  size_t size = out->ring.size();
+  if (n > size - out->length)
+    return false;
+
+  size_t tail = (out->head + out->length) % size;
+  size_t k = min(n, size - tail);
+  memcpy(&out->ring[tail], p, k);
+  memcpy(&out->ring[0], p + k, n - k);
+  out->length += n;
+  return true;
+}
+
+ssize_t Log::Send(Output *out, size_t n) {
+  // after what the stdio of the process holds for the same descriptor
+  fflush(out->fp);
+
+  size_t size = out->ring.size();
+  n = min(min(n, out->length), size - out->head);
+  ssize_t res = write(out->fd, &out->ring[out->head], n);
+  if (res > 0) {
+    out->head = (out->head + res) % size;
+    out->length -= res;
+  } else if (res < 0 && errno != EINTR && errno != EAGAIN) {
+    out->head = out->length = 0;  // gone, e.g. closed by the reader
+  }
+  return res;
+}
+
+}  // namespace v
@@ -0,0 +1,86 @@
+// log.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <poll.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <vector>
+
+namespace v {
+
+// Log keeps the messages of the pipe in a ring per output, the verbose
+// ones for standard output, the warnings for standard error, as warn() and
+// warnx() would write them; the pipe writes them out as the outputs take
+// them, polled along with the connections, so neither a slow reader of an
+// output nor a burst of messages holds the transfers back. A message
+// without room is dropped, and every level lets so many messages a second
+// through, the rest are suppressed; both are counted and told in the
+// output once there is room again.
+class Log {
+ public:
+  enum Level { LEVEL_INFO, LEVEL_WARNING, LEVELS };
+
+  Log();
+  ~Log();
+
+  // bytes kept per output, 64 KB by default
+  void Init(size_t size);
+  // as the setting methods of the pipe, messages a second per level, 0 for
+  // no bound
+  int SetRate(int n);
+
+  // as printf(), to standard output
+  void Info(const char *format, ...)
+      __attribute__((format(printf, 2, 3)));
+  // as warnx() and warn(), to standard error
+  void Warnx(const char *format, ...)
+      __attribute__((format(printf, 2, 3)));
+  void Warn(const char *format, ...)
+      __attribute__((format(printf, 2, 3)));
+
+  // sets the LEVELS descriptors to poll, -1 for the outputs with nothing
+  // pending
+  void Watch(struct pollfd *pfds) const;
+  // writes what the outputs polled writable take without blocking
+  void Drain(const struct pollfd *pfds);
+  // writes everything out, waiting for the outputs, e.g. at the end
+  void Flush();
+
+  void DumpStats(FILE *fp) const;
+
+ private:
+  struct Output {
+    int fd;
+    FILE *fp;            // of the same descriptor, flushed first
+    bool regular;        // a file, it never holds a write back
+    std::vector<char> ring;
+    size_t head;         // the oldest byte pending
+    size_t length;       // bytes pending
+    time_t window;       // the second counted
+    size_t count;        // messages in it
+    size_t suppressed;   // over the rate, not yet told
+    size_t dropped;      // without room, not yet told
+  };
+
+  void Write(Level level, bool error, const char *format, va_list ap);
+  bool Append(Output *out, const char *p, size_t n);
+  ssize_t Send(Output *out, size_t n);
+
+  Output outputs_[LEVELS];
+  int rate_;
+  size_t messages_;      // kept
+  size_t drops_;         // without room
+  size_t suppressions_;  // over the rate
+};
+
+}  // namespace v
+
+#endif  // LOG_H_
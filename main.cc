@@ -10,6 +10,7 @@
 #include <stddef.h>
 #include <string.h>
 #include <getopt.h>
+#include <libgen.h>
 #ifndef __ANDROID__
 #include <ifaddrs.h>
 #endif
@@ -22,6 +23,15 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include "pipe.h"
+#include "aggregate.h"
+#include "dedup.h"
+#include "encode.h"
+#include "backfill.h"
+#include "bucket.h"
+#include "control.h"
+#include "filter.h"
+#include "relay.h"
+#include "source.h"
 
 #define VERBOSE(field, ...) do { \
   if (enable_verbose) \
@@ -34,16 +44,82 @@ const char *program = "pipe";
 const char *version = "0.0.1";
 
 bool quit_program;
+bool dump_stats;
+bool reload_config;
+#ifdef NO_VERBOSE
+const bool enable_verbose = false;     // compiled out
+#else
 bool enable_verbose;
+#endif
 bool short_transaction;
-char destination[1024];                // destination URL
+const char *destinations[16];          // destination URLs, in priority
+size_t destination_count;
 size_t buffer_size = 1024 * 1024;      // 1 MB
 size_t transfer_rate = 12500;          // 100 Kbps
+bool transfer_rate_given;
 size_t connect_retry = 3;              // 3 times
 size_t idle_transfer_interval = 300;   // 5 minutes
 size_t idle_transfer_idle_limit = 1;   // 1 time
 size_t idle_transfer_busy_limit = 3;   // 3 times
 size_t zip_level = 0;                  // disable
+bool flow_control;
+size_t min_transfer_rate = 1250;       // 10 Kbps
+size_t max_transfer_interval = 3600;   // 1 hour
+size_t max_zip_level = 9;
+size_t connect_timeout = 10;           // 10 seconds
+size_t breaker_cooldown = 30;          // 30 seconds
+int mode = v::HttpPipe::MODE_FAILOVER;
+size_t max_lag = 4;                    // 4 batches
+int key_field = 1;                     // the first field
+int key_delimiter = ' ';
+int key_offset = 0;
+int key_length = 0;                    // by field
+const char *listen_address;            // relay mode if given
+const char *shm_path;                  // shared memory input if given
+struct FilterEntry {
+  const char *pattern;
+  bool keep;
+};
+FilterEntry filters[64];               // records dropped before batching
+size_t filter_count;
+size_t aggregate_interval = 0;         // disable
+size_t aggregate_series = 65536;
+size_t dedup_interval = 0;             // disable
+size_t dedup_records = 4096;
+const char *encode_format = NULL;       // disable
+size_t memory_limit = 0;               // no bound
+bool prefault;
+size_t idle_memory = 60;               // 1 minute
+bool huge_pages;
+bool lock_memory;
+const char *express_patterns[16];      // records for the express lane
+size_t express_pattern_count;
+size_t express_size = 64 * 1024;       // 64 KB
+size_t express_rate = 0;               // no limit
+bool express_link;
+size_t shedding = 0;                   // disable
+const char *host_bucket;               // host-wide rate if given
+size_t host_rate;
+size_t host_weight = 1;
+size_t host_share = 0;                 // no guarantee
+const char *backfill_file;             // backfill mode if given
+const char *backfill_checkpoint;
+int backfill_jobs;                     // the cores by default
+const char *control_path;              // runtime control if given
+const char *config_file;               // of control commands, on SIGHUP
+size_t log_rate = 100;                 // messages a second per level
+
+struct SourceEntry {                   // fan-in mode if any
+  const char *name;
+  const char *input;
+  const char *path;                    // NULL for the destination's
+  const char *tags;
+  int weight;
+  size_t rate;                         // 0 for no cap
+  size_t latency;                      // 0 for no bound
+};
+SourceEntry sources[256];
+size_t source_count;
 
 inline void Usage();
 inline void Version();
@@ -51,6 +127,10 @@ const char * GetMacAddress();
 size_t ParseSize(const char *s);
 size_t ParseRate(const char *s);
 size_t ParseInterval(const char *s);
+int ParseMode(const char *s);
+void ParseKey(const char *s);
+void ParseSources(const char *file);
+void AddInput(const char *scheme, const char *spec);
 void ParseOptions(int argc, char *argv[]);
 void SignalHandler(int signo);
 
@@ -59,6 +139,10 @@ class PostHeader : public v::Header {
   PostHeader()
       : mac_(NULL),
         path_(NULL),
+        source_(NULL),
+        tags_(NULL),
+        encoding_(NULL),
+        sample_(),
         compressed_(false),
         persistent_(true),
         host_(),
@@ -68,15 +152,16 @@ class PostHeader : public v::Header {
   }
 
   void SetRequest(const char *method, const char *uri, const char *ver) {
-    if (!path_)
+    if (path_ != uri) {  // changes on failover
+      content_length_offset_ = 0;
       path_ = uri;
-    else
-      assert(false);
+    }
   }
 
   void SetField(const char *field, const char *value) {
     if (strcasecmp(field, "Host") == 0) {
       snprintf(host_, sizeof(host_), "%s", value);
+      content_length_offset_ = 0;
     } else if (strcasecmp(field, "LETV-TV-MAC") == 0 && !mac_) {
       mac_ = value;
     } else if (strcasecmp(field, "LETV-ZIP") == 0) {
@@ -85,6 +170,27 @@ class PostHeader : public v::Header {
         content_length_offset_ = 0;
         compressed_ = t;
       }
+    } else if (strcasecmp(field, "LETV-Source") == 0) {
+      if (source_ != value) {  // changes with the input of the batch
+        content_length_offset_ = 0;
+        source_ = value;
+      }
+    } else if (strcasecmp(field, "LETV-Tags") == 0) {
+      if (tags_ != value) {
+        content_length_offset_ = 0;
+        tags_ = value;
+      }
+    } else if (strcasecmp(field, "LETV-Encoding") == 0) {
+      if (encoding_ != value) {
+        content_length_offset_ = 0;
+        encoding_ = value;
+      }
+    } else if (strcasecmp(field, "LETV-Sample-Rate") == 0) {
+      const char *t = value ? value : "";
+      if (strcmp(sample_, t) != 0) {  // a buffer of the pipe, by value
+        content_length_offset_ = 0;
+        snprintf(sample_, sizeof(sample_), "%s", t);
+      }
     } else if (strcasecmp(field, "Connection") == 0) {
       bool t = strcasecmp(value, "close");  // i.e. keep-alive
       if (persistent_ != t) {
@@ -104,6 +210,10 @@ class PostHeader : public v::Header {
                             "Accept: */*\r\n"
                             "LETV-TV-MAC: %s\r\n"
                             "%s"                  // LETV-ZIP: 1\r\n
+                            "%s%s%s"              // LETV-Source: ...\r\n
+                            "%s%s%s"              // LETV-Tags: ...\r\n
+                            "%s%s%s"              // LETV-Encoding: ...\r\n
+                            "%s%s%s"              // LETV-Sample-Rate: ...\r\n
                             "%s"                  // Connection: close\r\n
                             "Content-Length: ";
       content_length_offset_ = snprintf(buffer_, sizeof(buffer_),
@@ -113,6 +223,18 @@ class PostHeader : public v::Header {
                                         program, version,
                                         mac_,
                                         compressed_ ? "LETV-ZIP: 1\r\n" : "",
+                                        source_ ? "LETV-Source: " : "",
+                                        source_ ? source_ : "",
+                                        source_ ? "\r\n" : "",
+                                        tags_ ? "LETV-Tags: " : "",
+                                        tags_ ? tags_ : "",
+                                        tags_ ? "\r\n" : "",
+                                        encoding_ ? "LETV-Encoding: " : "",
+                                        encoding_ ? encoding_ : "",
+                                        encoding_ ? "\r\n" : "",
+                                        *sample_ ? "LETV-Sample-Rate: " : "",
+                                        sample_,
+                                        *sample_ ? "\r\n" : "",
                                         persistent_ ? "" : "Connection: close\r\n");
     }
 
@@ -128,6 +250,10 @@ class PostHeader : public v::Header {
  private:
   const char *mac_;
   const char *path_;
+  const char *source_;
+  const char *tags_;
+  const char *encoding_;
+  char sample_[16];
   bool compressed_;
   bool persistent_;
   char host_[64];
@@ -142,8 +268,13 @@ int main(int argc, char *argv[]) {
   signal(SIGINT, SignalHandler);
   signal(SIGTERM, SignalHandler);
   signal(SIGQUIT, SignalHandler);
+  signal(SIGUSR1, SignalHandler);
 
   ParseOptions(argc, argv);
+  if (config_file) {
+    signal(SIGHUP, SignalHandler);
+    reload_config = true;  // once serving, then on every SIGHUP
+  }
 
   PostHeader header;
   header.SetField("LETV-TV-MAC", GetMacAddress());
@@ -151,18 +282,135 @@ int main(int argc, char *argv[]) {
     header.SetField("Connection", "close");
 
   v::HttpPipe pipe;
-  pipe.Init(STDIN_FILENO, destination);
+  pipe.Init(STDIN_FILENO, destinations[0]);
+  for (size_t i = 1; i < destination_count; ++i)
+    pipe.AddDestination(destinations[i]);
   pipe.SetBufferSize(buffer_size);
+  pipe.SetMemoryLimit(memory_limit);
+  pipe.SetPrefault(prefault);
+  pipe.SetIdleMemory(idle_memory);
+  pipe.SetHugePages(huge_pages);
+  pipe.SetLockMemory(lock_memory);
   pipe.SetConnectRetry(connect_retry);
   pipe.SetIdleTransfer(idle_transfer_idle_limit);
   pipe.SetBusyTransfer(idle_transfer_busy_limit);
   pipe.SetTransferRate(transfer_rate);
   pipe.SetZipLevel(zip_level);
   pipe.SetVerbose(enable_verbose);
+  pipe.SetLogRate(log_rate);
   pipe.SetHeader(&header);
+  pipe.SetFlowControl(flow_control);
+  pipe.SetMinTransferRate(min_transfer_rate);
+  pipe.SetMaxTransferInterval(max_transfer_interval);
+  pipe.SetMaxZipLevel(max_zip_level);
+  pipe.SetConnectTimeout(connect_timeout);
+  pipe.SetBreakerCooldown(breaker_cooldown);
+  pipe.SetMode(mode);
+  pipe.SetMaxLag(max_lag);
+  pipe.SetKeyField(key_field);
+  pipe.SetKeyDelimiter(key_delimiter);
+  pipe.SetKeyOffset(key_offset);
+  pipe.SetKeyLength(key_length);
+  v::Filter filter;
+  for (size_t i = 0; i < filter_count; ++i)
+    filter.AddPattern(filters[i].pattern, filters[i].keep);
+  if (filter_count)
+    pipe.AddStage(&filter, "filter");
+  v::Aggregator aggregator;
+  if (aggregate_interval) {
+    aggregator.Init(aggregate_interval, aggregate_series);
+    pipe.AddStage(&aggregator, "aggregate");
+  }
+  v::Dedup dedup;
+  if (dedup_interval) {
+    dedup.Init(dedup_interval, dedup_records);
+    pipe.AddStage(&dedup, "dedup");
+  }
+  v::ColumnEncoder encoder;
+  if (encode_format) {
+    if (!encoder.SetFormat(encode_format))
+      errx(1, "Invalid format: %s, time, dict or text columns expect.",
+           encode_format);
+    pipe.SetEncoder(&encoder);
+  }
+  for (size_t i = 0; i < express_pattern_count; ++i)
+    pipe.AddExpressPattern(express_patterns[i]);
+  pipe.SetExpressSize(express_size);
+  pipe.SetExpressRate(express_rate);
+  pipe.SetExpressLink(express_link);
+  pipe.SetShedding(shedding);
+
+  v::SharedBucket bucket;
+  if (host_rate) {
+    if (!bucket.Open(host_bucket, host_rate))
+      errx(1, "unable to share the host rate at %s", host_bucket);
+    bucket.SetWeight(host_weight);
+    bucket.SetMinShare(host_share);
+    pipe.SetLimiter(&bucket);
+  }
+
+  v::Relay relay;
+  if (listen_address) {
+    relay.SetVerbose(enable_verbose);
+    if (!relay.Listen(listen_address))
+      errx(1, "unable to relay at %s", listen_address);
+    pipe.SetSource(&relay);
+  }
+
+  for (size_t i = 0; i < source_count; ++i) {
+    const SourceEntry &e = sources[i];
+    v::Source *source = v::OpenSource(e.input);
+    if (!source)
+      errx(1, "unable to open source %s: %s", e.name, e.input);
+    int k = pipe.AddSource(source, e.name, e.path, e.tags);
+    pipe.SetSourceWeight(k, e.weight);
+    pipe.SetSourceRate(k, e.rate);
+    pipe.SetSourceLatency(k, e.latency);
+  }
+  if (listen_address && (source_count || shm_path))
+    pipe.AddSource(&relay, "relay", NULL, NULL);
+
+  v::Source *shm = NULL;
+  if (shm_path) {
+    char spec[1024];
+    snprintf(spec, sizeof(spec), "shm:%s", shm_path);
+    shm = v::OpenSource(spec);
+    if (!shm)
+      errx(1, "unable to share memory at %s", shm_path);
+    if (source_count || listen_address)
+      pipe.AddSource(shm, "shm", NULL, NULL);
+    else
+      pipe.SetSource(shm);
+  }
+
+  v::ControlSocket control;
+  if (control_path || config_file) {
+    control.SetVerbose(enable_verbose);
+    if (control_path && !control.Listen(control_path))
+      errx(1, "unable to control at %s", control_path);
+    control.SetConfig(config_file);
+    control.SetReloadFlag(&reload_config);
+    pipe.SetControl(&control);
+  }
 
   pipe.SetStopFlag(&quit_program);
+  pipe.SetDumpFlag(&dump_stats);
+
+  if (backfill_file) {
+    v::Backfill backfill;
+    if (!backfill.Open(backfill_file, backfill_checkpoint, backfill_jobs))
+      errx(1, "unable to backfill %s", backfill_file);
+    if (!backfill.Run(&pipe, transfer_rate_given ? transfer_rate : 0,
+                      &quit_program))
+      errx(1, "backfill of %s is unfinished, run again to resume",
+           backfill_file);
+    return 0;
+  }
+
   pipe.Serve(idle_transfer_interval);
+
+  if (enable_verbose)
+    pipe.DumpStats(stdout);
 }
 
 namespace {
@@ -176,14 +424,112 @@ inline void Usage() {
          "  -h             Print this help and exit\n"
          "  -v             Print program version and exit\n"
          "  -S             Use short connection\n"
-         "  -d DEST        Pipe destination URL\n"
+         "  -d DEST        Pipe destination URL, repeat for failover\n"
          "  -c LEVEL       Enable ZIP compress (1~9)\n"
          "  -s BUFSIZ      The buffer size, default 1 MB\n"
          "  -r RATE        Transfer rate, default 100 K/s\n"
          "  -n TRY         Failed connect try, default 3 times\n"
          "  -i INTERVAL    Transfer interval, default 5 minutes\n"
          "  -l LIMIT       Limit to transfer occur in idle, default 1 times\n"
-         "  -L LIMIT       Limit to transfer occur in busy, default 3 times\n",
+         "  -L LIMIT       Limit to transfer occur in busy, default 3 times\n"
+         "  -F             Follow flow control hints from the server\n"
+         "  -R RATE        Lowest rate the server may ask, default 10 K/s\n"
+         "  -I INTERVAL    Longest interval the server may ask, default 1 hour\n"
+         "  -C LEVEL       Highest ZIP level the server may ask, default 9\n"
+         "  -t TIMEOUT     Connect timeout, default 10 seconds\n"
+         "  -B INTERVAL    Skip a failed destination for, default 30 seconds\n"
+         "  -m MODE        Use of destinations, failover, replicate or route,\n"
+         "                 default failover\n"
+         "  -q LAG         Batches a replica may fall behind, default 4\n"
+         "  -k KEY         Routing key, a field number or OFFSET+LENGTH,\n"
+         "                 default the first field\n"
+         "  -K DELIM       Field delimiter of the routing key, default space\n"
+         "  --listen ADDR  Relay the pipes posting to [HOST:]PORT instead of\n"
+         "                 piping standard input\n"
+         "  --shm PATH     Take the input from a producer writing to shared\n"
+         "                 memory, attached at the unix socket PATH, instead\n"
+         "                 of standard input, see shmring.h\n"
+         "  --tail FILE[,STATE]\n"
+         "                 Follow FILE through rotations instead of standard\n"
+         "                 input, from where STATE was acknowledged if given,\n"
+         "                 else from its end, repeatable\n"
+         "  --udp [HOST:]PORT[,RCVBUF]\n"
+         "                 Take datagrams, e.g. of syslog, as records instead\n"
+         "                 of standard input, with a receive buffer of RCVBUF\n"
+         "                 bytes if given, an IPv6 HOST in brackets,\n"
+         "                 repeatable\n"
+         "  --backfill FILE[,CHECKPOINT]\n"
+         "                 Upload FILE at once with parallel connections and\n"
+         "                 exit, resuming from CHECKPOINT, by default\n"
+         "                 FILE.backfill in the current directory; the\n"
+         "                 transfer interval and limits are ignored, the\n"
+         "                 rate is of all connections, default no limit\n"
+         "  --jobs N       Connections of a backfill, default the cores\n"
+         "  --drop PATTERN Drop the records starting with ^PREFIX, ending with\n"
+         "                 SUFFIX$, or with PATTERN in them, repeatable\n"
+         "  --keep PATTERN Drop the records without any such PATTERN,\n"
+         "                 repeatable; a record is kept if it has a keep\n"
+         "                 pattern and no drop pattern\n"
+         "  --aggregate INTERVAL[,SERIES]\n"
+         "                 Roll up the lines of KEY VALUE TIMESTAMP into one\n"
+         "                 of the sum per key and INTERVAL, keeping SERIES\n"
+         "                 keys at most, default 65536, before sending them\n"
+         "  --dedup INTERVAL[,RECORDS]\n"
+         "                 Send a record repeated within INTERVAL once, and\n"
+         "                 then once more with the times it was repeated,\n"
+         "                 keeping RECORDS records at most, default 4096\n"
+         "  --encode FORMAT\n"
+         "                 Send the records of FORMAT, columns split by ' '\n"
+         "                 such as \"time dict dict text\", by column, each\n"
+         "                 time as the difference from the one before, each\n"
+         "                 dict by its index in the values of the batch\n"
+         "  --express PATTERN\n"
+         "                 Send the records starting with ^PREFIX, or with\n"
+         "                 PATTERN in them, ahead of the others, repeatable\n"
+         "  --express-size BUFSIZ\n"
+         "                 The express buffer size, default 64 KB\n"
+         "  --express-rate RATE\n"
+         "                 Transfer rate of express records, default no limit\n"
+         "  --express-link Send express records on a connection of their own\n"
+         "  --shed PERCENT Sample the records by session under overload, down\n"
+         "                 to PERCENT of them, default disable\n"
+         "  --host-rate RATE\n"
+         "                 Transfer rate of all pipes of the host, default\n"
+         "                 no limit\n"
+         "  --host-bucket NAME\n"
+         "                 Share the host rate in /dev/shm/NAME, default\n"
+         "                 pipe-bucket\n"
+         "  --host-weight WEIGHT\n"
+         "                 Weight of this pipe in the host rate, default 1\n"
+         "  --host-share RATE\n"
+         "                 Least share of this pipe in the host rate\n"
+         "  --memory BYTES Memory of the buffers at most, at least 4 buffer\n"
+         "                 sizes, default no limit; once it is used up the\n"
+         "                 input is held back\n"
+         "  --prefault     Map the buffers at start rather than on demand,\n"
+         "                 and keep them\n"
+         "  --idle-memory INTERVAL\n"
+         "                 Give the memory unused for INTERVAL back to the\n"
+         "                 system, default 60 seconds, 0 to keep it\n"
+         "  --huge-pages   Use huge pages for the buffers of 2 MB and up\n"
+         "  --lock-memory  Lock the buffers in memory\n"
+         "  -f FILE        Fan in the inputs listed in the file, one per line:\n"
+         "                 NAME INPUT [PATH|- [OPTION=VALUE...] [TAGS]], where\n"
+         "                 INPUT is fifo:PATH, file:PATH, unix:PATH,\n"
+         "                 shm:PATH, tail:FILE[,STATE], udp:[HOST:]PORT\n"
+         "                 [,RCVBUF], unixgram:PATH[,RCVBUF] or stdin, see\n"
+         "                 --shm, --tail and --udp, and OPTION is weight,\n"
+         "                 rate or latency\n"
+         "  --control PATH Take commands at the unix socket PATH, one a line,\n"
+         "                 e.g. \"rate 800K\", \"zip 6\", \"interval 1m\" or\n"
+         "                 \"stats\", answered with the value replaced, see\n"
+         "                 control.h\n"
+         "  --config FILE  Run the commands of FILE once serving, and again\n"
+         "                 on SIGHUP\n"
+         "  --log-rate N   Verbose messages and warnings a second, each, the\n"
+         "                 others are counted only, default 100, 0 for all\n"
+         "\n"
+         "Send SIGUSR1 to dump the statistics to standard error.\n",
          program);
   exit(0);
 }
@@ -337,12 +683,173 @@ size_t ParseInterval(const char *s) {
   return value;
 }
 
+int ParseMode(const char *s) {
+  if (strcasecmp(s, "failover") == 0)
+    return v::HttpPipe::MODE_FAILOVER;
+  if (strcasecmp(s, "replicate") == 0)
+    return v::HttpPipe::MODE_REPLICATE;
+  if (strcasecmp(s, "route") == 0)
+    return v::HttpPipe::MODE_ROUTE;
+
+  errx(1, "Invalid argument: %s, failover, replicate or route expect.", s);
+}
+
+void ParseKey(const char *s) {
+  if (sscanf(s, "%d+%d", &key_offset, &key_length) == 2 &&
+      key_offset >= 0 && key_length > 0)
+    return;
+
+  char *endptr;
+  key_field = strtol(s, &endptr, 10);
+  key_length = 0;
+  if (*endptr || key_field < 1)
+    errx(1, "Invalid argument: %s, FIELD or OFFSET+LENGTH expect.", s);
+}
+
+void ParseSources(const char *file) {
+  FILE *fp = fopen(file, "r");
+  if (!fp)
+    err(1, "unable to open %s", file);
+
+  char line[4096];
+  for (int lineno = 1; fgets(line, sizeof(line), fp); ++lineno) {
+    char *p = line + strspn(line, " \t");
+    if (*p == '#' || *p == '\n' || *p == 0)
+      continue;
+
+    // NAME INPUT [PATH|- [OPTION=VALUE...] [TAGS]], the tags run to the end
+    // of the line
+    char name[256], input[1024], path[1024];
+    int n = 0;
+    int fields = sscanf(p, "%255s %1023s %1023s %n", name, input, path, &n);
+    if (fields < 2)
+      errx(1, "%s:%d: NAME INPUT [PATH [TAGS]] expect", file, lineno);
+    if (source_count == sizeof(sources) / sizeof(*sources))
+      errx(1, "too many sources, %zu at most", source_count);
+
+    SourceEntry *e = &sources[source_count++];
+    e->name = strdup(name);
+    e->input = strdup(input);
+    e->path = fields == 3 && strcmp(path, "-") != 0 ? strdup(path) : NULL;
+    e->tags = NULL;
+    e->weight = 1;
+    e->rate = 0;
+    e->latency = 0;
+    if (fields < 3 || n == 0)
+      continue;
+
+    p += n;
+    p[strcspn(p, "\r\n")] = 0;
+    char option[64];
+    while (sscanf(p, "%63s%n", option, &n) == 1) {
+      if (strncmp(option, "weight=", 7) == 0)
+        e->weight = atoi(option + 7);
+      else if (strncmp(option, "rate=", 5) == 0)
+        e->rate = ParseRate(option + 5);
+      else if (strncmp(option, "latency=", 8) == 0)
+        e->latency = ParseInterval(option + 8);
+      else
+        break;
+      p += n;
+      p += strspn(p, " \t");
+    }
+    if (e->weight < 1)
+      errx(1, "%s:%d: weight should be positive", file, lineno);
+    if (*p)
+      e->tags = strdup(p);
+  }
+  fclose(fp);
+}
+
+void AddInput(const char *scheme, const char *spec) {
+  if (source_count == sizeof(sources) / sizeof(*sources))
+    errx(1, "too many sources, %zu at most", source_count);
+
+  // named by the address, the options after it are not part of it
+  char input[1024];
+  snprintf(input, sizeof(input), "%s:%s", scheme, spec);
+  SourceEntry *e = &sources[source_count++];
+  e->name = strndup(spec, strcspn(spec, ","));
+  e->input = strdup(input);
+  e->path = NULL;
+  e->tags = NULL;
+  e->weight = 1;
+  e->rate = 0;
+  e->latency = 0;
+}
+
 void ParseOptions(int argc, char *argv[]) {
+  enum {
+    OPT_LISTEN = 256,
+    OPT_SHM,
+    OPT_TAIL,
+    OPT_UDP,
+    OPT_BACKFILL,
+    OPT_JOBS,
+    OPT_DROP,
+    OPT_KEEP,
+    OPT_AGGREGATE,
+    OPT_DEDUP,
+    OPT_ENCODE,
+    OPT_EXPRESS,
+    OPT_EXPRESS_SIZE,
+    OPT_EXPRESS_RATE,
+    OPT_EXPRESS_LINK,
+    OPT_MEMORY,
+    OPT_PREFAULT,
+    OPT_IDLE_MEMORY,
+    OPT_HUGE_PAGES,
+    OPT_LOCK_MEMORY,
+    OPT_SHED,
+    OPT_HOST_RATE,
+    OPT_HOST_BUCKET,
+    OPT_HOST_WEIGHT,
+    OPT_HOST_SHARE,
+    OPT_CONTROL,
+    OPT_CONFIG,
+    OPT_LOG_RATE,
+  };
+  static const struct option options[] = {
+    {"listen", required_argument, NULL, OPT_LISTEN},
+    {"shm", required_argument, NULL, OPT_SHM},
+    {"tail", required_argument, NULL, OPT_TAIL},
+    {"udp", required_argument, NULL, OPT_UDP},
+    {"backfill", required_argument, NULL, OPT_BACKFILL},
+    {"jobs", required_argument, NULL, OPT_JOBS},
+    {"drop", required_argument, NULL, OPT_DROP},
+    {"keep", required_argument, NULL, OPT_KEEP},
+    {"aggregate", required_argument, NULL, OPT_AGGREGATE},
+    {"dedup", required_argument, NULL, OPT_DEDUP},
+    {"encode", required_argument, NULL, OPT_ENCODE},
+    {"express", required_argument, NULL, OPT_EXPRESS},
+    {"express-size", required_argument, NULL, OPT_EXPRESS_SIZE},
+    {"express-rate", required_argument, NULL, OPT_EXPRESS_RATE},
+    {"express-link", no_argument, NULL, OPT_EXPRESS_LINK},
+    {"memory", required_argument, NULL, OPT_MEMORY},
+    {"prefault", no_argument, NULL, OPT_PREFAULT},
+    {"idle-memory", required_argument, NULL, OPT_IDLE_MEMORY},
+    {"huge-pages", no_argument, NULL, OPT_HUGE_PAGES},
+    {"lock-memory", no_argument, NULL, OPT_LOCK_MEMORY},
+    {"shed", required_argument, NULL, OPT_SHED},
+    {"host-rate", required_argument, NULL, OPT_HOST_RATE},
+    {"host-bucket", required_argument, NULL, OPT_HOST_BUCKET},
+    {"host-weight", required_argument, NULL, OPT_HOST_WEIGHT},
+    {"host-share", required_argument, NULL, OPT_HOST_SHARE},
+    {"control", required_argument, NULL, OPT_CONTROL},
+    {"config", required_argument, NULL, OPT_CONFIG},
+    {"log-rate", required_argument, NULL, OPT_LOG_RATE},
+    {NULL, 0, NULL, 0},
+  };
+
   int opt;
-  while ((opt = getopt(argc, argv, "VhvSd:c:s:r:n:i:l:L:")) != -1) {
+  while ((opt = getopt_long(argc, argv,
+                            "VhvSFd:c:s:r:n:i:l:L:R:I:C:t:B:m:q:k:K:f:",
+                            options, NULL)) != -1) {
     switch (opt) {
       case 'V':
+#ifndef NO_VERBOSE
         enable_verbose = true;
+#endif
         break;
 
       case 'h':
@@ -358,7 +865,9 @@ void ParseOptions(int argc, char *argv[]) {
         break;
 
       case 'd':
-        strncpy(destination, optarg, sizeof(destination) - 1);
+        if (destination_count == sizeof(destinations) / sizeof(*destinations))
+          errx(1, "too many destinations, %zu at most", destination_count);
+        destinations[destination_count++] = optarg;
         break;
 
       case 'c':
@@ -371,6 +880,7 @@ void ParseOptions(int argc, char *argv[]) {
 
       case 'r':
         transfer_rate = ParseRate(optarg);
+        transfer_rate_given = true;
         break;
 
       case 'n':
@@ -389,27 +899,310 @@ void ParseOptions(int argc, char *argv[]) {
         idle_transfer_busy_limit = atoi(optarg);
         break;
 
+      case 'F':
+        flow_control = true;
+        break;
+
+      case 'R':
+        min_transfer_rate = ParseRate(optarg);
+        break;
+
+      case 'I':
+        max_transfer_interval = ParseInterval(optarg);
+        break;
+
+      case 'C':
+        max_zip_level = atoi(optarg);
+        break;
+
+      case 't':
+        connect_timeout = ParseInterval(optarg);
+        break;
+
+      case 'B':
+        breaker_cooldown = ParseInterval(optarg);
+        break;
+
+      case 'm':
+        mode = ParseMode(optarg);
+        break;
+
+      case 'q':
+        max_lag = atoi(optarg);
+        break;
+
+      case 'k':
+        ParseKey(optarg);
+        break;
+
+      case 'K':
+        key_delimiter = *optarg == '\\' && optarg[1] == 't' ? '\t' : *optarg;
+        break;
+
+      case OPT_LISTEN:
+        listen_address = optarg;
+        break;
+
+      case OPT_SHM:
+        shm_path = optarg;
+        break;
+
+      case OPT_TAIL:
+        AddInput("tail", optarg);
+        break;
+
+      case OPT_UDP:
+        AddInput("udp", optarg);
+        break;
+
+      case OPT_BACKFILL: {
+        // the checkpoint in the current directory by default
+        char *checkpoint = strchr(optarg, ',');
+        char path[1024], name[1024];
+        if (checkpoint) {
+          *checkpoint++ = 0;
+        } else {
+          snprintf(path, sizeof(path), "%s", optarg);
+          snprintf(name, sizeof(name), "%s.backfill", basename(path));
+          checkpoint = name;
+        }
+        backfill_file = optarg;
+        backfill_checkpoint = strdup(checkpoint);
+        break;
+      }
+
+      case OPT_JOBS:
+        backfill_jobs = atoi(optarg);
+        if (backfill_jobs < 1)
+          errx(1, "Invalid argument: %s, positive number expect.", optarg);
+        break;
+
+      case OPT_DROP:
+      case OPT_KEEP:
+        if (filter_count == sizeof(filters) / sizeof(*filters))
+          errx(1, "too many filter patterns, %zu at most", filter_count);
+        filters[filter_count].pattern = optarg;
+        filters[filter_count].keep = opt == OPT_KEEP;
+        ++filter_count;
+        break;
+
+      case OPT_AGGREGATE: {
+        const char *comma = strchr(optarg, ',');
+        char interval[32];
+        snprintf(interval, sizeof(interval), "%.*s",
+                 comma ? static_cast<int>(comma - optarg) : 31, optarg);
+        aggregate_interval = ParseInterval(interval);
+        if (comma)
+          aggregate_series = strtoul(comma + 1, NULL, 10);
+        if (!aggregate_interval || !aggregate_series)
+          errx(1, "Invalid argument: %s, INTERVAL[,SERIES] expect.", optarg);
+        break;
+      }
+
+      case OPT_DEDUP: {
+        const char *comma = strchr(optarg, ',');
+        char interval[32];
+        snprintf(interval, sizeof(interval), "%.*s",
+                 comma ? static_cast<int>(comma - optarg) : 31, optarg);
+        dedup_interval = ParseInterval(interval);
+        if (comma)
+          dedup_records = strtoul(comma + 1, NULL, 10);
+        if (!dedup_interval || !dedup_records)
+          errx(1, "Invalid argument: %s, INTERVAL[,RECORDS] expect.", optarg);
+        break;
+      }
+
+      case OPT_ENCODE:
+        encode_format = optarg;
+        break;
+
+      case OPT_EXPRESS:
+        if (express_pattern_count ==
+            sizeof(express_patterns) / sizeof(*express_patterns))
+          errx(1, "too many express patterns, %zu at most",
+               express_pattern_count);
+        express_patterns[express_pattern_count++] = optarg;
+        break;
+
+      case OPT_EXPRESS_SIZE:
+        express_size = ParseSize(optarg);
+        break;
+
+      case OPT_EXPRESS_RATE:
+        express_rate = ParseRate(optarg);
+        break;
+
+      case OPT_EXPRESS_LINK:
+        express_link = true;
+        break;
+
+      case OPT_MEMORY:
+        memory_limit = ParseSize(optarg);
+        break;
+
+      case OPT_PREFAULT:
+        prefault = true;
+        break;
+
+      case OPT_IDLE_MEMORY:
+        idle_memory = ParseInterval(optarg);
+        break;
+
+      case OPT_HUGE_PAGES:
+        huge_pages = true;
+        break;
+
+      case OPT_LOCK_MEMORY:
+        lock_memory = true;
+        break;
+
+      case OPT_SHED:
+        shedding = atoi(optarg);
+        if (shedding < 1 || shedding > 100)
+          errx(1, "Invalid argument: %s, 1~100 expect.", optarg);
+        break;
+
+      case OPT_HOST_RATE:
+        host_rate = ParseRate(optarg);
+        break;
+
+      case OPT_HOST_BUCKET:
+        host_bucket = optarg;
+        break;
+
+      case OPT_HOST_WEIGHT:
+        host_weight = atoi(optarg);
+        if (host_weight < 1)
+          errx(1, "Invalid argument: %s, positive weight expect.", optarg);
+        break;
+
+      case OPT_HOST_SHARE:
+        host_share = ParseRate(optarg);
+        break;
+
+      case OPT_CONTROL:
+        control_path = optarg;
+        break;
+
+      case OPT_CONFIG:
+        config_file = optarg;
+        break;
+
+      case OPT_LOG_RATE:
+        log_rate = atoi(optarg);
+        break;
+
+      case 'f':
+        ParseSources(optarg);
+        break;
+
       default:
         exit(1);
     }
   }
 
-  if (!destination[0])
+  if (!destination_count)
     errx(1, "missing destination, expect an URL");
+#ifdef NO_ZIP
+  if (zip_level)
+    errx(1, "ZIP compress is not built in");
+#endif
+  if (backfill_file && (source_count || listen_address || shm_path))
+    errx(1, "a backfill takes no other input");
+  if (backfill_file && (control_path || config_file))
+    errx(1, "a backfill takes no control");
+  if (memory_limit && memory_limit < 4 * buffer_size)
+    errx(1, "too little memory: %zu, 4 buffers of %zu bytes at least",
+         memory_limit, buffer_size);
+  if (!backfill_jobs)
+    backfill_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+                    sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
   VERBOSE(Short-Transaction, "%d\n", short_transaction);
   VERBOSE(Zip-Level, "%zu\n", zip_level);
-  VERBOSE(Destination, "%s\n", destination);
+  for (size_t i = 0; i < destination_count; ++i)
+    VERBOSE(Destination, "%s\n", destinations[i]);
+  if (listen_address)
+    VERBOSE(Listen, "%s\n", listen_address);
+  if (shm_path)
+    VERBOSE(Shm, "%s\n", shm_path);
+  if (backfill_file)
+    VERBOSE(Backfill, "%s, checkpoint %s, %d jobs\n", backfill_file,
+            backfill_checkpoint, backfill_jobs);
+  for (size_t i = 0; i < source_count; ++i)
+    VERBOSE(Source, "%s %s %s weight %d, rate %zu(bytes/s), latency %zu(sec) "
+            "%s\n", sources[i].name, sources[i].input,
+            sources[i].path ? sources[i].path : "-", sources[i].weight,
+            sources[i].rate, sources[i].latency,
+            sources[i].tags ? sources[i].tags : "");
   VERBOSE(Buffer-Size, "%zu(bytes)\n", buffer_size);
   VERBOSE(Transfer-Rate, "%zu(bytes/s)\n", transfer_rate);
   VERBOSE(Connect-Retry, "%zu(times)\n", connect_retry);
   VERBOSE(Idle-Transfer-Interval, "%zu(sec)\n", idle_transfer_interval);
   VERBOSE(Idle-Transfer-Idle-Limit, "%zu(times)\n", idle_transfer_idle_limit);
   VERBOSE(Idle-Transfer-Busy-Limit, "%zu(times)\n", idle_transfer_busy_limit);
+  VERBOSE(Flow-Control, "%d\n", flow_control);
+  VERBOSE(Min-Transfer-Rate, "%zu(bytes/s)\n", min_transfer_rate);
+  VERBOSE(Max-Transfer-Interval, "%zu(sec)\n", max_transfer_interval);
+  VERBOSE(Max-Zip-Level, "%zu\n", max_zip_level);
+  VERBOSE(Connect-Timeout, "%zu(sec)\n", connect_timeout);
+  VERBOSE(Breaker-Cooldown, "%zu(sec)\n", breaker_cooldown);
+  VERBOSE(Mode, "%d\n", mode);
+  VERBOSE(Max-Lag, "%zu(batches)\n", max_lag);
+  for (size_t i = 0; i < filter_count; ++i) {
+    if (filters[i].keep)
+      VERBOSE(Keep, "%s\n", filters[i].pattern);
+    else
+      VERBOSE(Drop, "%s\n", filters[i].pattern);
+  }
+  if (aggregate_interval)
+    VERBOSE(Aggregate, "%zu(sec), %zu(series)\n", aggregate_interval,
+            aggregate_series);
+  if (dedup_interval)
+    VERBOSE(Dedup, "%zu(sec), %zu(records)\n", dedup_interval, dedup_records);
+  if (encode_format)
+    VERBOSE(Encode, "%s\n", encode_format);
+  for (size_t i = 0; i < express_pattern_count; ++i)
+    VERBOSE(Express, "%s\n", express_patterns[i]);
+  if (express_pattern_count) {
+    VERBOSE(Express-Size, "%zu(bytes)\n", express_size);
+    VERBOSE(Express-Rate, "%zu(bytes/s)\n", express_rate);
+    VERBOSE(Express-Link, "%d\n", express_link);
+  }
+  if (shedding)
+    VERBOSE(Shedding, "down to %zu%%\n", shedding);
+  if (memory_limit)
+    VERBOSE(Memory, "%zu(bytes)\n", memory_limit);
+  VERBOSE(Idle-Memory, "%zu(sec)\n", idle_memory);
+  VERBOSE(Log-Rate, "%zu(messages/s)\n", log_rate);
+  if (prefault || huge_pages || lock_memory)
+    VERBOSE(Memory-Options, "%s%s%s\n", prefault ? " prefault" : "",
+            huge_pages ? " huge-pages" : "", lock_memory ? " lock" : "");
+  if (!host_bucket)
+    host_bucket = "pipe-bucket";
+  if (host_rate) {
+    VERBOSE(Host-Rate, "%zu(bytes/s) in /dev/shm/%s\n", host_rate,
+            host_bucket);
+    VERBOSE(Host-Weight, "%zu\n", host_weight);
+    VERBOSE(Host-Share, "%zu(bytes/s)\n", host_share);
+  }
+  if (control_path)
+    VERBOSE(Control, "%s\n", control_path);
+  if (config_file)
+    VERBOSE(Config, "%s\n", config_file);
+  if (mode == v::HttpPipe::MODE_ROUTE && key_length > 0)
+    VERBOSE(Routing-Key, "bytes %d+%d\n", key_offset, key_length);
+  else if (mode == v::HttpPipe::MODE_ROUTE)
+    VERBOSE(Routing-Key, "field %d by '%c'\n", key_field, key_delimiter);
 }
 
 void SignalHandler(int signo) {
-  quit_program = true;
+  if (signo == SIGUSR1)
+    dump_stats = true;
+  else if (signo == SIGHUP)
+    reload_config = true;
+  else
+    quit_program = true;
 }
 
 }  // anonymous namespace
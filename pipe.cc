@@ -2,27 +2,36 @@
 // Copyright 2014 <Vegertar, vegertar@gmail.com>
 
 #include "pipe.h"
+#include "ring.h"
 
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
 #include <limits.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <sys/uio.h>
+#ifndef NO_ZIP
 #include <zlib.h>
+#endif
 #include <string>
 #include <vector>
 #include <algorithm>
 
 #define ILLEGAL(n)  (n < 0 && errno != EINTR && errno != EAGAIN)
 #define RESETFD(fd) do { close(fd); fd = -1; } while (0)
+#define MIN_READ    65536  // an input buffer grows to take at least this
 
 using std::max;
 using std::min;
@@ -30,10 +39,10 @@ using std::vector;
 
 namespace {
 
-inline useconds_t GetTime() {
+inline int64_t GetTime() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
-  return tv.tv_sec * 1000000 + tv.tv_usec;
+  return tv.tv_sec * (int64_t)1000000 + tv.tv_usec;
 }
 
 inline void NonBlocking(int fd, int on) {
@@ -41,7 +50,7 @@ inline void NonBlocking(int fd, int on) {
     warn("%s: ioctl(FIONBIO, %d) error", __func__, on);
 }
 
-int TcpNonBlockConnect(const char *host, const char *serv) {
+int TcpNonBlockConnect(const char *host, const char *serv, v::Log *log) {
   int s, rv;
   struct addrinfo hints, *servinfo, *p;
 
@@ -50,7 +59,7 @@ int TcpNonBlockConnect(const char *host, const char *serv) {
   hints.ai_socktype = SOCK_STREAM;
 
   if ((rv = getaddrinfo(host, serv, &hints, &servinfo)) != 0) {
-    warnx("%s: getaddrinfo() error: %s", __func__, gai_strerror(rv));
+    log->Warnx("%s: getaddrinfo() error: %s", __func__, gai_strerror(rv));
     return -1;
   }
 
@@ -68,7 +77,8 @@ int TcpNonBlockConnect(const char *host, const char *serv) {
     break;
   }
   if (p == NULL) {
-    warn("%s: error for %s, %s", __func__, host, serv);
+    log->Warn("%s: error for %s, %s", __func__, host, serv);
+    freeaddrinfo(servinfo);
     return -1;
   }
 
@@ -76,10 +86,39 @@ int TcpNonBlockConnect(const char *host, const char *serv) {
   return s;
 }
 
+// feeds the lanes filled by the pipe itself
+class NullSource : public v::Source {
+ public:
+  int Descriptor() const { return -1; }
+  ssize_t Read(char *buf, size_t n) { errno = EAGAIN; return -1; }
+};
+
+NullSource null_source;
+
 }  // anonymous namespace
 
 namespace v {
 
+FdSource::FdSource(int fd)
+    : fd_(fd) {
+  // empty
+}
+
+int FdSource::SetFd(int fd) {
+  int old = fd_;
+  if (fd >= 0)
+    fd_ = fd;
+  return old;
+}
+
+int FdSource::Descriptor() const {
+  return fd_;
+}
+
+ssize_t FdSource::Read(char *buf, size_t n) {
+  return read(fd_, buf, n);
+}
+
 HttpPipe::HttpPipe()
     : buffer_size_(1048576),  // 1M
       connect_retry_(3),
@@ -88,89 +127,491 @@ HttpPipe::HttpPipe()
       stop_flag_(NULL),
       transfer_rate_(12500),  // 100Kb
       zip_level_(0),  // disable
+#ifndef NO_VERBOSE
       verbose_(0),  // disable
+#endif
       header_(NULL),
-      in_offset_(0),
-      out_offset_(0),
-      out_length_(0),
-      hdr_offset_(0),
-      hdr_length_(0),
-      content_length_(0),
-      content_length_backup_(0),
-      milestone(0),
-      infd_(STDIN_FILENO),
-      host_(),
-      port_(),
-      path_(),
-      request_state_(HTTP_HEAD),
-      response_state_(HTTP_HEAD),
-      http_flow_(HTTP_REQUEST),
-      connect_retry_n_(0),
-      persistent_(false) {
+      flow_control_(0),  // disable
+      min_transfer_rate_(1250),  // 10Kb
+      transfer_interval_(0),
+      max_transfer_interval_(3600),  // 1 hour
+      max_zip_level_(9),
+      connect_timeout_(10),
+      breaker_cooldown_(30),
+      dump_flag_(NULL),
+      mode_(MODE_FAILOVER),
+      max_lag_(4),
+      key_field_(1),
+      key_delimiter_(' '),
+      key_offset_(0),
+      key_length_(0),  // by field
+      express_patterns_(),
+      express_size_(65536),  // 64K
+      express_rate_(0),  // no limit
+      express_link_(0),  // shared
+      shedding_(0),  // disable
+      limiter_(NULL),
+      encoder_(NULL),
+      control_(NULL),
+      prefault_(0),
+      idle_memory_(60),
+      stages_(),
+      flow_rate_(0),
+      flow_batch_(0),
+      flow_interval_(0),
+      flow_zip_level_(0),
+      input_(),
+      inbox_(NULL),
+      source_(&input_),
+      lanes_(),
+      next_lane_(0),
+      express_lane_(-1),
+      stage_lane_(-1),
+      shed_time_(0),
+      shed_input_(0),
+      shed_output_(0),
+      shed_overflows_(0),
+      sample_field_(),
+      destinations_(),
+      links_(),
+      spare_(),
+      zip_stream_(NULL),
+      zip_stream_level_(0),
+      zip_time_(0),
+      release_time_(0),
+      ring_(),
+      stats_() {
   // empty
 }
 
+HttpPipe::~HttpPipe() {
+  // every batch is either waiting for acknowledgement or spare
+  for (size_t i = 0; i < lanes_.size(); ++i)
+    for (size_t j = 0; j < lanes_[i].unacked.size(); ++j)
+      delete lanes_[i].unacked[j];
+  for (size_t i = 0; i < spare_.size(); ++i)
+    delete spare_[i];
+
+  EndZip();
+  delete inbox_;
+}
+
 void HttpPipe::Init(int infd, const char *outurl) {
   if (infd >= 0)
-    infd_ = infd;
+    input_.SetFd(infd);
   if (outurl)
     ParseURL(outurl);
 }
 
+bool HttpPipe::InitRing(size_t size) {
+  Ring *ring = new Ring;
+  if (!ring->Init(size)) {
+    delete ring;
+    return false;
+  }
+
+  delete inbox_;
+  inbox_ = ring;
+  source_ = inbox_;
+  return true;
+}
+
+bool HttpPipe::Write(const void *p, size_t n) {
+  return inbox_ && inbox_->Write(p, n);
+}
+
+void * HttpPipe::Reserve(size_t n) {
+  return inbox_ ? inbox_->Reserve(n) : NULL;
+}
+
+void HttpPipe::Commit(void *p) {
+  inbox_->Commit(p);
+}
+
+void HttpPipe::AddDestination(const char *url) {
+  if (!url)
+    return;
+
+  // while serving, the links of the whole list take the new one too
+  int last = destinations_.size();
+  ParseURL(url);
+  for (size_t i = 0; i < links_.size(); ++i)
+    if (links_[i].last == last && links_[i].first == 0 &&
+        (mode_ == MODE_FAILOVER || links_[i].express))
+      links_[i].last = destinations_.size();
+}
+
+int HttpPipe::AddSource(Source *source, const char *name, const char *path,
+                        const char *tags) {
+  Lane lane;
+  source->SetLog(&log_);
+  lane.source = source;
+  lane.name = name;
+  lane.path = path;
+  lane.tags = tags;
+  lane.offset = 0;
+  lane.scanned = 0;
+  lane.closed = false;
+  lane.read_time = 0;
+  lane.bytes = 0;
+  lane.batch_time = 0;
+  lane.idle_n = 0;
+  lane.busy_n = 0;
+  lane.first_time = 0;
+  lane.weight = 1;
+  lane.rate = 0;  // no cap
+  lane.latency = 0;
+  lane.deficit = 0;
+  lane.allowance = 0;
+  lane.refill_time = 0;
+  lane.due = false;
+  lane.overflowed = false;
+  lane.sample = 1000;
+  lane.stats = NULL;
+  lanes_.push_back(lane);
+
+  SourceStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.name = name;
+  stats_.sources.push_back(stats);
+  return lanes_.size() - 1;
+}
+
+int HttpPipe::SetSourceWeight(int i, int n) {
+  assert(0 <= i && i < (int)lanes_.size());
+  int old = lanes_[i].weight;
+  if (n > 0)
+    lanes_[i].weight = n;
+  return old;
+}
+
+int HttpPipe::SetSourceRate(int i, int n) {
+  assert(0 <= i && i < (int)lanes_.size());
+  int old = lanes_[i].rate;
+  if (n >= 0)
+    lanes_[i].rate = n;
+  return old;
+}
+
+int HttpPipe::SetSourceLatency(int i, int n) {
+  assert(0 <= i && i < (int)lanes_.size());
+  int old = lanes_[i].latency;
+  if (n >= 0)
+    lanes_[i].latency = n;
+  return old;
+}
+
+void HttpPipe::AddExpressPattern(const char *pattern) {
+  if (pattern && *pattern)
+    express_patterns_.push_back(pattern);
+}
+
+int HttpPipe::SetExpressSize(int n) {
+  int old = express_size_;
+  if (n > 0)
+    express_size_ = n;
+  return old;
+}
+
+int HttpPipe::SetExpressRate(int n) {
+  int old = express_rate_;
+  if (n >= 0)
+    express_rate_ = n;
+  return old;
+}
+
+int HttpPipe::SetExpressLink(int n) {
+  int old = express_link_;
+  if (n >= 0)
+    express_link_ = n;
+  return old;
+}
+
+Limiter * HttpPipe::SetLimiter(Limiter *p) {
+  Limiter *old = limiter_;
+  if (p)
+    limiter_ = p;
+  return old;
+}
+
+int HttpPipe::SetMemoryLimit(int n) {
+  return pool_.SetLimit(n >= 0 ? n : -1);
+}
+
+int HttpPipe::SetPrefault(int n) {
+  int old = prefault_;
+  if (n >= 0)
+    prefault_ = n;
+  return old;
+}
+
+int HttpPipe::SetIdleMemory(int n) {
+  int old = idle_memory_;
+  if (n >= 0)
+    idle_memory_ = n;
+  return old;
+}
+
+int HttpPipe::SetHugePages(int n) {
+  return pool_.SetHugePages(n);
+}
+
+int HttpPipe::SetLockMemory(int n) {
+  return pool_.SetLockMemory(n);
+}
+
+Encoder * HttpPipe::SetEncoder(Encoder *p) {
+  Encoder *old = encoder_;
+  if (p)
+    encoder_ = p;
+  return old;
+}
+
+Control * HttpPipe::SetControl(Control *p) {
+  Control *old = control_;
+  if (p) {
+    control_ = p;
+    control_->SetLog(&log_);
+  }
+  return old;
+}
+
+int HttpPipe::SetTransferInterval(int n) {
+  int old = transfer_interval_;
+  if (n > 0)
+    transfer_interval_ = flow_interval_ = n;
+  return old;
+}
+
+int HttpPipe::SetShedding(int n) {
+  int old = shedding_;
+  if (n >= 0)
+    shedding_ = min(n, 100);
+  return old;
+}
+
+int HttpPipe::AddStage(Stage *stage, const char *name) {
+  stages_.push_back(stage);
+
+  StageStats stats;
+  memset(&stats, 0, sizeof(stats));
+  stats.name = name;
+  stats_.stages.push_back(stats);
+  return stages_.size() - 1;
+}
+
+const Stats & HttpPipe::GetStats() const {
+  return stats_;
+}
+
+void HttpPipe::DumpStats(FILE *fp) const {
+  fprintf(fp, "batches: %zu\n", stats_.batches);
+  fprintf(fp, "requests: %zu\n", stats_.requests);
+  fprintf(fp, "bytes: %zu\n", stats_.bytes);
+  for (size_t i = 0; i < links_.size(); ++i) {
+    const LinkStats &s = stats_.links[i];
+    const Destination &d = destinations_[s.destination];
+    fprintf(fp, "link %zu: destination %d (%s%s), requests %zu, bytes %zu, "
+            "lag %zu, drops %zu, failovers %zu, failover-time %.3f(sec)\n",
+            i, s.destination, d.host_field, d.path, s.requests, s.bytes,
+            s.lag, s.drops, s.failovers, s.failover_time);
+  }
+  for (size_t i = 0; i < stats_.sources.size(); ++i) {
+    const SourceStats &s = stats_.sources[i];
+    if (lanes_.size() > 1 || s.lost)
+      fprintf(fp, "source %zu (%s): batches %zu, bytes %zu, overflows %zu, "
+              "max-wait %.3f(sec), lost %zu\n",
+              i, s.name ? s.name : "", s.batches, s.bytes, s.overflows,
+              s.max_wait, s.lost);
+  }
+  for (size_t i = 0; i < stats_.stages.size(); ++i) {
+    const StageStats &s = stats_.stages[i];
+    fprintf(fp, "stage %zu (%s): records %zu, drops %zu, time %.3f(sec)\n",
+            i, s.name ? s.name : "", s.records, s.drops, s.time);
+    stages_[i]->DumpStats(fp);
+  }
+  if (encoder_)
+    encoder_->DumpStats(fp);
+  pool_.DumpStats(fp);
+  log_.DumpStats(fp);
+  if (shedding_)
+    fprintf(fp, "shedding: sample-rate %d/1000, sheds %zu, records %zu, "
+            "bytes %zu\n", stats_.sample_rate, stats_.sheds,
+            stats_.shed_records, stats_.shed_bytes);
+  if (inbox_)
+    fprintf(fp, "ring: refused %zu\n", inbox_->Refused());
+  fflush(fp);
+}
+
 void HttpPipe::Serve(int timeout) {
-  struct pollfd fds[2] = {
-    {infd_, POLLIN}, {-1, POLLIN},
-  };
+  assert(!destinations_.empty());
+  SetupLinks();
+  if (lanes_.empty())
+    AddSource(source_, NULL, NULL, NULL);
+  if (!express_patterns_.empty()) {
+    express_lane_ = AddSource(&null_source, "express", NULL, NULL);
+    lanes_[express_lane_].closed = true;  // filled by the pipe
+  }
+  if (!stages_.empty()) {
+    stage_lane_ = AddSource(&null_source, "stages", NULL, NULL);
+    lanes_[stage_lane_].closed = true;
+  }
+
+  // the inputs come first, then the links, the control and the log
+  size_t nl = lanes_.size();
+  size_t nc = nl + links_.size();
+  vector<struct pollfd> fds(nc + 1 + Log::LEVELS);
+  for (size_t i = 0; i < fds.size(); ++i) {
+    fds[i].fd = -1;
+    fds[i].events = POLLIN;
+    fds[i].revents = 0;
+  }
 
-  int idle = 0;
-  int busy = 0;
   int delay = 0;
   int interval = timeout;
-  char host_field[70] = "";
-  snprintf(host_field, sizeof(host_field), "%s:%s", host_, port_);
+  transfer_interval_ = flow_interval_ = timeout;
+  flow_rate_ = transfer_rate_;
+  flow_batch_ = 0;
+  flow_zip_level_ = zip_level_;
 
-  inbuf_.reserve(buffer_size_);
-  outbuf_.reserve(buffer_size_);
-  hdrbuf_.reserve(MAX_QUERY);
   othbuf_.reserve(MAX_QUERY);
-  header_->SetRequest("POST", path_, "HTTP/1.1");
-  header_->SetField("Host", host_field);
-
-  milestone = GetTime();
+  stats_.sample_rate = 1000;
+
+  // a buffer of every input and one of a batch in flight, faulted in now
+  // rather than in the first burst
+  if (prefault_)
+    pool_.Reserve(buffer_size_, 2 * nl);
+  shed_time_ = GetTime();
+
+  for (size_t i = 0; i < nl; ++i) {
+    lanes_[i].batch_time = time(NULL);
+    lanes_[i].read_time = time(NULL);
+    lanes_[i].refill_time = GetTime();
+    lanes_[i].stats = &stats_.sources[i];
+  }
 
   while (!stop_flag_ || !*stop_flag_) {
-    if (connect_retry_n_ > connect_retry_)
+    size_t given_up = 0;
+    for (size_t i = 0; i < links_.size(); ++i)
+      if (links_[i].connect_retry_n > connect_retry_)
+        ++given_up;
+    if (given_up == links_.size())
       break;
 
-    int status = CheckTransfer(&idle, &busy);
-    if (status == -1 && fds[0].fd == -1)
+    if (dump_flag_ && *dump_flag_) {
+      *dump_flag_ = false;
+      DumpStats(stderr);
+    }
+
+    // in between two turns, so never in the middle of a batch
+    if (control_ && (control_->Ready() || (fds[nc].revents & POLLIN)))
+      control_->Run(this);
+
+    size_t closed = 0;
+    for (size_t i = 0; i < nl; ++i)
+      if (lanes_[i].closed)
+        ++closed;
+
+    // what the stages hold is let out once the inputs end
+    size_t stage_offset = 0;
+    if (stage_lane_ >= 0) {
+      EmitStages(closed == nl);
+      stage_offset = lanes_[stage_lane_].offset;
+    }
+
+    ControlShedding();
+    ReleaseIdle();
+    int status = CheckTransfer();
+    if (status == -1 && closed == nl)
       break;
 
-    SetOutput(status == 1, &fds[1]);
+    // wake up in time to give up a destination that does not answer, or to
+    // resume a link held back by the transfer rate
+    int64_t now = GetTime();
+    int wait = interval * 1000;
+    for (size_t i = 0; i < nl; ++i) {
+      // a lossless source waits while its buffer is full
+      Lane *lane = &lanes_[i];
+      bool open = !lane->closed && HasRoom(*lane);
+      fds[i].fd = open ? lane->source->Descriptor() : -1;
+      if (open && lane->source->Ready())
+        wait = 0;
+
+      // in time for the latency bound, or for the rate cap to let it go
+      if (lane->latency > 0 && lane->offset > 0) {
+        int64_t deadline = lane->first_time + lane->latency * (int64_t)1000000;
+        wait = min<int64_t>(wait, max<int64_t>(deadline - now, 0) / 1000 + 1);
+      }
+      if (lane->rate > 0 && lane->allowance < 0 && lane->offset > 0)
+        wait = min<int64_t>(wait, -lane->allowance * 1000 / lane->rate + 1);
+    }
+    // in time to give back the memory left unused
+    if (idle_memory_ > 0 && (pool_.Mapped() > 0 || zip_stream_))
+      wait = min(wait, idle_memory_ * 1000);
+    // a stage left due has no room for its lines, it waits for the links
+    // to take the lane, unless it is cut already
+    for (size_t i = 0; i < stages_.size(); ++i) {
+      int64_t due = stages_[i]->Due();
+      if (due == 0 && lanes_[stage_lane_].offset >= stage_offset)
+        continue;
+      if (due >= 0)
+        wait = min<int64_t>(wait, due / 1000 + 1);
+    }
+    for (size_t i = 0; i < links_.size(); ++i) {
+      Link *link = &links_[i];
+      SetOutput(link, &fds[nl + i]);
+      if (fds[nl + i].fd >= 0 && link->connecting)
+        wait = min(wait, connect_timeout_ * 1000);
+      if (Resume(*link) > now)
+        wait = min<int64_t>(wait, (Resume(*link) - now) / 1000 + 1);
+    }
 
-    time_t before = time(NULL);
-    int res = poll(fds, 2, interval * 1000);
+    fds[nc].fd = control_ ? control_->Descriptor() : -1;
+    log_.Watch(&fds[nc + 1]);
 
-    if (res == 0) {
-      idle = 0;
-      busy = 0;
-      Rollback();
+    time_t before = time(NULL);
+    int res = poll(&fds[0], fds.size(), wait);
+
+    if (res == 0 && wait == interval * 1000) {
+      for (size_t i = 0; i < links_.size(); ++i) {
+        // nothing heard for a whole interval, start over on a new connection
+        Link *link = &links_[i];
+        if (Rollback(link) && fds[nl + i].fd >= 0)
+          RESETFD(fds[nl + i].fd);
+      }
     } else if (res < 0 && errno != EINTR) {
       err(1, "%s: poll() error", __func__);
     } else if (res > 0) {
-      HandleError(&fds[1]);
-      HandleOutput(&fds[1]);
-      HandleInput(&fds[0]);
+      for (size_t i = 0; i < links_.size(); ++i) {
+        HandleError(&links_[i], &fds[nl + i]);
+        HandleOutput(&links_[i], &fds[nl + i]);
+      }
     }
 
+    if (res >= 0)
+      for (size_t i = 0; i < nl; ++i)
+        HandleInput(&lanes_[i], &fds[i]);
+    if (res > 0)
+      log_.Drain(&fds[nc + 1]);
+
     delay += time(NULL) - before;
-    if (delay < timeout) {
-      interval = timeout - delay;
+    if (delay < flow_interval_) {
+      interval = flow_interval_ - delay;
     } else {
-      interval = timeout;
+      // a new interval, with a new allowance of transfers
+      interval = flow_interval_;
       delay = 0;
+      for (size_t i = 0; i < nl; ++i) {
+        lanes_[i].idle_n = 0;
+        lanes_[i].busy_n = 0;
+      }
     }
   }
+
+  for (size_t i = nl; i < nc; ++i)
+    if (fds[i].fd >= 0)
+      RESETFD(fds[i].fd);
+  log_.Flush();
 }
 
 int HttpPipe::SetBufferSize(int n) {
@@ -201,6 +642,69 @@ int HttpPipe::SetBusyTransfer(int n) {
   return old;
 }
 
+int HttpPipe::SetConnectTimeout(int n) {
+  int old = connect_timeout_;
+  if (n >= 0)
+    connect_timeout_ = n;
+  return old;
+}
+
+int HttpPipe::SetBreakerCooldown(int n) {
+  int old = breaker_cooldown_;
+  if (n >= 0)
+    breaker_cooldown_ = n;
+  return old;
+}
+
+bool * HttpPipe::SetDumpFlag(bool *p) {
+  bool *old = dump_flag_;
+  if (p)
+    dump_flag_ = p;
+  return old;
+}
+
+int HttpPipe::SetMode(int n) {
+  int old = mode_;
+  if (n >= 0)
+    mode_ = n;
+  return old;
+}
+
+int HttpPipe::SetMaxLag(int n) {
+  int old = max_lag_;
+  if (n >= 0)
+    max_lag_ = n;
+  return old;
+}
+
+int HttpPipe::SetKeyField(int n) {
+  int old = key_field_;
+  if (n >= 0)
+    key_field_ = n;
+  return old;
+}
+
+int HttpPipe::SetKeyDelimiter(int c) {
+  int old = key_delimiter_;
+  if (c >= 0)
+    key_delimiter_ = c;
+  return old;
+}
+
+int HttpPipe::SetKeyOffset(int n) {
+  int old = key_offset_;
+  if (n >= 0)
+    key_offset_ = n;
+  return old;
+}
+
+int HttpPipe::SetKeyLength(int n) {
+  int old = key_length_;
+  if (n >= 0)
+    key_length_ = n;
+  return old;
+}
+
 bool * HttpPipe::SetStopFlag(bool *p) {
   bool *old = stop_flag_;
   if (p)
@@ -211,21 +715,34 @@ bool * HttpPipe::SetStopFlag(bool *p) {
 int HttpPipe::SetTransferRate(int n) {
   int old = transfer_rate_;
   if (n >= 0)
-    transfer_rate_ = n;
+    transfer_rate_ = flow_rate_ = n;
   return old;
 }
 
 int HttpPipe::SetZipLevel(int n) {
   int old = zip_level_;
   if (n >= 0)
-    zip_level_ = n;
+    zip_level_ = flow_zip_level_ = n;
   return old;
 }
 
+int HttpPipe::SetLogRate(int n) {
+  return log_.SetRate(n);
+}
+
 int HttpPipe::SetVerbose(int n) {
   int old = verbose_;
+#ifndef NO_VERBOSE
   if (n >= 0)
     verbose_ = n;
+#endif
+  return old;
+}
+
+Source * HttpPipe::SetSource(Source *p) {
+  Source *old = source_;
+  if (p)
+    source_ = p;
   return old;
 }
 
@@ -236,152 +753,822 @@ Header * HttpPipe::SetHeader(Header *p) {
   return old;
 }
 
-int HttpPipe::CheckTransfer(int *idle_transfer_n, int *busy_transfer_n) {
-  if (in_offset_ == 0 &&
-      out_length_ == out_offset_ &&
-      http_flow_ == HTTP_REQUEST)
+int HttpPipe::SetFlowControl(int n) {
+  int old = flow_control_;
+  if (n >= 0)
+    flow_control_ = n;
+  return old;
+}
+
+int HttpPipe::SetMinTransferRate(int n) {
+  int old = min_transfer_rate_;
+  if (n >= 0)
+    min_transfer_rate_ = n;
+  return old;
+}
+
+int HttpPipe::SetMaxTransferInterval(int n) {
+  int old = max_transfer_interval_;
+  if (n >= 0)
+    max_transfer_interval_ = n;
+  return old;
+}
+
+int HttpPipe::SetMaxZipLevel(int n) {
+  int old = max_zip_level_;
+  if (n >= 0)
+    max_zip_level_ = n;
+  return old;
+}
+
+int HttpPipe::CheckTransfer() {
+  bool pending = false;  // some link has batches to deliver
+  bool ready = false;    // some link is able to take a new batch
+  for (size_t i = 0; i < links_.size(); ++i) {
+    if (!links_[i].queue.empty())
+      pending = true;
+    else if (!links_[i].express)
+      ready = true;
+  }
+
+  bool buffered = false;
+  for (size_t i = 0; i < lanes_.size(); ++i)
+    if (lanes_[i].offset > 0)
+      buffered = true;
+
+  if (!buffered && !pending)
     return -1;
 
-  if (http_flow_ == HTTP_RESPONSE)
-    return 0;
+  // express records wait for nothing
+  if (express_lane_ >= 0 && lanes_[express_lane_].offset > 0) {
+    CutBatch(&lanes_[express_lane_]);
+    pending = true;
+  }
+
+  // each free link takes a batch of the input picked by the scheduler
+  Lane *lane;
+  while (ready && (lane = PickLane()) != NULL) {
+    CutBatch(lane);
+    pending = true;
+    ready = false;
+    for (size_t i = 0; i < links_.size(); ++i)
+      if (links_[i].queue.empty() && !links_[i].express)
+        ready = true;
+  }
+
+  return pending ? 1 : 0;
+}
+
+bool HttpPipe::IsDue(const Lane &lane, int64_t now) const {
+  size_t n = lane.offset;
+  if (n == 0)
+    return false;
+
+  if (lane.closed)
+    return true;  // the rest of an input at its end, nothing more to wait
+
+  if (IsFull(lane) || lane.overflowed)  // busy
+    return lane.busy_n < busy_transfer_;
+
+  if (lane.latency > 0 &&
+      now - lane.first_time >= lane.latency * (int64_t)1000000)
+    return true;  // late, whatever the allowance of idle transfers
+
+  return (n >= flow_batch_ ||  // idle
+          time(NULL) - lane.batch_time >= flow_interval_) &&
+         lane.idle_n < idle_transfer_;
+}
+
+HttpPipe::Lane * HttpPipe::PickLane() {
+  // deficit round-robin: a due input earns weight * MIN_READ bytes a round
+  // and is served once it has earned its buffered bytes; rather than
+  // spinning, the rounds needed by the nearest one are credited at once
+  int64_t now = GetTime();
+  size_t n = lanes_.size();
+  Lane *late = NULL;
+  Lane *next = NULL;
+  size_t rounds = 0;
+
+  for (size_t k = 0; k < n; ++k) {
+    Lane *lane = &lanes_[(next_lane_ + k) % n];
+    if (lane - &lanes_[0] == express_lane_)
+      continue;
+
+    if (lane->rate > 0) {
+      int64_t earned = (now - lane->refill_time) * lane->rate / 1000000;
+      if (earned > 0) {
+        lane->allowance = min<int64_t>(lane->allowance + earned, lane->rate);
+        lane->refill_time = now;
+      }
+    }
 
-  if (out_length_ > out_offset_)
-    return 1;
+    lane->due = IsDue(*lane, now) &&
+                (lane->rate == 0 || lane->allowance >= 0);
+    if (!lane->due) {
+      if (lane->offset == 0)
+        lane->deficit = 0;  // nothing queued keeps no credit
+      continue;
+    }
 
-  if ((0 < in_offset_ && in_offset_ < (size_t)buffer_size_ &&  // idle
-       (*idle_transfer_n)++ < idle_transfer_) ||
-      (in_offset_ >= (size_t)buffer_size_ &&                   // busy
-       (*busy_transfer_n)++ < busy_transfer_)) {
-    inbuf_.swap(outbuf_);
-    out_length_ = in_offset_;
-    in_offset_ = 0;
-    out_offset_ = 0;
-    return 1;
+    if (lane->latency > 0 &&
+        now - lane->first_time >= lane->latency * (int64_t)1000000 &&
+        (!late || lane->first_time < late->first_time))
+      late = lane;
+
+    size_t quantum = (size_t)lane->weight * MIN_READ;
+    size_t r = lane->offset > lane->deficit ?
+               (lane->offset - lane->deficit + quantum - 1) / quantum : 0;
+    if (!next || r < rounds) {
+      next = lane;
+      rounds = r;
+    }
   }
 
-  return 0;
+  if (!next)
+    return NULL;
+
+  for (size_t i = 0; i < n && rounds > 0; ++i)
+    if (lanes_[i].due)
+      lanes_[i].deficit += rounds * lanes_[i].weight * MIN_READ;
+
+  Lane *lane = late ? late : next;
+  lane->deficit -= min(lane->deficit, lane->offset);
+  if (lane->rate > 0)
+    lane->allowance -= lane->offset;
+  if (IsFull(*lane) || lane->overflowed)
+    ++lane->busy_n;
+  else
+    ++lane->idle_n;
+  lane->overflowed = false;
+  next_lane_ = (lane - &lanes_[0] + 1) % n;
+  return lane;
 }
 
-ssize_t HttpPipe::ReadInput(int fd) {
-  if (in_offset_ == (size_t)buffer_size_) {
-    warnx("input OVERFLOW, overwriting.");
-    in_offset_ = 0;  // overwrite
+void HttpPipe::CutBatch(Lane *lane) {
+  bool express = lane - &lanes_[0] == express_lane_;
+  if (mode_ == MODE_ROUTE && !(express && express_link_)) {
+    RouteBatch(lane);
+    return;
   }
 
-  ssize_t n = read(fd, &inbuf_[in_offset_], buffer_size_ - in_offset_);
-  if (n > 0)
-    in_offset_ += n;
+  // an incomplete record is kept for the next batch, unless the input is
+  // closed or the record fills the buffer, so a batch is whole records
+  size_t tail = 0;
+  if (!lane->closed) {
+    const char *p = lane->buffer.data();
+    while (tail < lane->offset && p[lane->offset - tail - 1] != '\n')
+      ++tail;
+    if (tail == lane->offset)
+      tail = 0;
+  }
+
+  // the batch takes the buffer, the lane a new one for the tail, which is
+  // sent along if there is no memory for it
+  Buffer rest;
+  if (tail > 0 && !pool_.Grow(&rest, 0, max<size_t>(tail, MIN_READ)))
+    tail = 0;
+
+  Batch *batch = AllocBatch(lane, 0);
+  lane->buffer.swap(batch->data);
+  batch->length = lane->offset - tail;
+  batch->end = lane->bytes - tail;
+  lane->scanned = 0;
+  ++lane->stats->batches;
+  lane->stats->bytes += batch->length;
+  lane->stats->max_wait = max(lane->stats->max_wait,
+                              (GetTime() - lane->first_time) / 1E6);
+  if (tail > 0) {
+    memcpy(rest.data(), &batch->data[batch->length], tail);
+    lane->buffer.swap(rest);
+    lane->first_time = GetTime();
+  }
+  lane->offset = tail;
+  lane->batch_time = time(NULL);
+  ++stats_.batches;
+
+  // encoded and compressed here once, whatever the number of links
+  Encode(batch);
+  if (flow_zip_level_ > 0)
+    batch->zipped = ZipCompress(&batch->data, &batch->length);
+
+  for (size_t i = 0; i < links_.size(); ++i)
+    if (Takes(links_[i], *batch))
+      QueueBatch(&links_[i], batch);
+}
+
+void HttpPipe::RouteBatch(Lane *lane) {
+  UpdateRing();
+
+  vector<Batch *> batches(links_.size(), static_cast<Batch *>(NULL));
+  const char *p = lane->buffer.data();
+  const char *end = p + lane->offset;
+
+  while (p < end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (!eol) {
+      // wait for the rest of the record, unless it will never come
+      if (!lane->closed && lane->offset < (size_t)buffer_size_)
+        break;
+      eol = end - 1;
+    }
+
+    size_t n = eol + 1 - p;
+    size_t key_size;
+    const char *key = RecordKey(p, n, &key_size);
+    int i = ring_.Lookup(key, key_size);
+
+    // the rest waits for the memory of the batches on the way
+    Batch *batch = batches[i];
+    if (!batch && !(batch = batches[i] = AllocBatch(lane, lane->offset)))
+      break;
+    memcpy(&batch->data[batch->length], p, n);
+    batch->length += n;
+    p += n;
+  }
+
+  ++lane->stats->batches;
+  lane->stats->bytes += p - lane->buffer.data();
+  lane->stats->max_wait = max(lane->stats->max_wait,
+                              (GetTime() - lane->first_time) / 1E6);
+
+  // the incomplete record is kept for the next batch
+  lane->offset = end - p;
+  memmove(&lane->buffer[0], p, lane->offset);
+  lane->scanned = 0;
+  lane->batch_time = time(NULL);
+  lane->first_time = GetTime();
+
+  for (size_t i = 0; i < batches.size(); ++i) {
+    Batch *batch = batches[i];
+    if (!batch)
+      continue;
+
+    batch->end = lane->bytes - lane->offset;
+    ++stats_.batches;
+    Encode(batch);
+    if (flow_zip_level_ > 0)
+      batch->zipped = ZipCompress(&batch->data, &batch->length);
+    QueueBatch(&links_[i], batch);
+  }
+}
+
+void HttpPipe::UpdateRing() {
+  // a destination with its breaker open is off the ring until it cools
+  // down, then the records routed to it again are the probe; if all are
+  // open, the ring is left as it is and the records wait
+  time_t now = time(NULL);
+  vector<bool> wanted(destinations_.size());
+  bool any = false;
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    const Destination &d = destinations_[i];
+    wanted[i] = d.state != BREAKER_OPEN || now - d.opened >= d.cooldown;
+    any = any || wanted[i];
+  }
+  if (!any)
+    return;
+
+  bool initial = ring_.Empty();
+  for (size_t i = 0; i < destinations_.size(); ++i) {
+    Destination *d = &destinations_[i];
+    if (d->routed == wanted[i])
+      continue;
+
+    if (wanted[i]) {
+      // named by the URL, so the ring stays put when the list is reordered
+      char name[1100];
+      snprintf(name, sizeof(name), "%s%s", d->host_field, d->path);
+      ring_.Add(i, name);
+    } else {
+      ring_.Remove(i);
+    }
+    d->routed = wanted[i];
+    if (verbose_ && !initial)
+      log_.Info("* Route: %s %s the ring\n", d->host_field,
+                d->routed ? "back on" : "off");
+  }
+}
+
+HttpPipe::Batch * HttpPipe::AllocBatch(Lane *lane, size_t capacity) {
+  if (capacity > 0 && !pool_.Available(capacity))
+    return NULL;
+
+  Batch *batch;
+  if (spare_.empty()) {
+    batch = new Batch;
+  } else {
+    batch = spare_.back();
+    spare_.pop_back();
+  }
+
+  if (capacity > 0)
+    pool_.Grow(&batch->data, 0, capacity);
+  batch->length = 0;
+  batch->zipped = false;
+  batch->encoded = false;
+  batch->refs = 0;
+  batch->lane = lane - &lanes_[0];
+  batch->end = 0;
+  batch->lost = false;
+  batch->done = false;
+  batch->express = batch->lane == express_lane_;
+  batch->sample = lane->sample;
+  lane->unacked.push_back(batch);
+  return batch;
+}
+
+void HttpPipe::QueueBatch(Link *link, Batch *batch) {
+  ++batch->refs;
+  if (batch->express && !link->queue.empty()) {
+    // ahead of the bulk batches, after the one in transfer and the express
+    // ones before it
+    bool started = link->out_offset > 0 || link->hdr_offset > 0 ||
+                   link->http_flow == HTTP_RESPONSE;
+    deque<Batch *>::iterator it = link->queue.begin() + (started ? 1 : 0);
+    while (it != link->queue.end() && (*it)->express)
+      ++it;
+    link->queue.insert(it, batch);
+  } else {
+    link->queue.push_back(batch);
+  }
+
+  // a replica too far behind skips its oldest waiting bulk batch rather
+  // than hold back the others
+  while (link->queue.size() > 1 + (size_t)max_lag_) {
+    size_t i = 1;
+    while (i < link->queue.size() && link->queue[i]->express)
+      ++i;
+    if (i == link->queue.size())
+      break;
+
+    Batch *skipped = link->queue[i];
+    link->queue.erase(link->queue.begin() + i);
+    skipped->lost = true;
+    ++link->stats->drops;
+    ReleaseBatch(skipped);
+    if (verbose_)
+      log_.Info("* Link %d lagging, skipped a batch\n",
+                static_cast<int>(link - &links_[0]));
+  }
+  link->stats->lag = link->queue.size();
+}
+
+const char * HttpPipe::RecordKey(const char *p, size_t n,
+                                 size_t *key_size) const {
+  if (n > 0 && p[n - 1] == '\n')
+    --n;
+
+  if (key_length_ > 0) {
+    size_t offset = min<size_t>(key_offset_, n);
+    *key_size = min<size_t>(key_length_, n - offset);
+    return p + offset;
+  }
+
+  const char *end = p + n;
+  for (int field = 1; field < key_field_ && p < end; ++field) {
+    const char *q = static_cast<const char *>(memchr(p, key_delimiter_,
+                                                     end - p));
+    p = q ? q + 1 : end;
+  }
+
+  const char *q = static_cast<const char *>(memchr(p, key_delimiter_,
+                                                   end - p));
+  *key_size = (q ? q : end) - p;
+  return p;
+}
+
+void HttpPipe::ReleaseBatch(Batch *batch) {
+  if (--batch->refs == 0) {
+    batch->done = true;
+    AcknowledgeBatches(&lanes_[batch->lane]);
+  }
+}
+
+void HttpPipe::AcknowledgeBatches(Lane *lane) {
+  // in input order, so the source learns of a contiguous range; batches
+  // routed from the same cut share the end and are acknowledged together
+  deque<Batch *> &unacked = lane->unacked;
+  while (!unacked.empty() && unacked.front()->done) {
+    uint64_t end = unacked.front()->end;
+    bool ok = true;
+    while (!unacked.empty() && unacked.front()->done &&
+           unacked.front()->end == end) {
+      ok = ok && !unacked.front()->lost;
+      pool_.Release(&unacked.front()->data);
+      spare_.push_back(unacked.front());
+      unacked.pop_front();
+    }
+    if (!unacked.empty() && unacked.front()->end == end)
+      break;  // the rest of the cut is still on the way
+
+    lane->source->Acknowledge(end, ok);
+  }
+}
+
+ssize_t HttpPipe::ReadInput(Lane *lane) {
+  if (lane->offset >= (size_t)buffer_size_) {
+    log_.Warnx("input OVERFLOW, overwriting.");
+    lane->offset = 0;  // overwrite
+    lane->scanned = 0;
+    lane->overflowed = true;
+    ++lane->stats->overflows;
+  }
+
+  // grown by doubling up to the buffer size, keeping what is read so far,
+  // as the memory lets
+  size_t need = NeedRoom(*lane);
+  size_t step = max<size_t>(need, MIN_READ);
+  size_t capacity = min<size_t>(lane->buffer.capacity(), buffer_size_);
+  if (capacity - lane->offset < step && capacity < (size_t)buffer_size_) {
+    size_t larger = min<size_t>(max<size_t>(capacity * 2,
+                                            lane->offset + step),
+                                buffer_size_);
+    if (pool_.Grow(&lane->buffer, lane->offset, larger))
+      capacity = min<size_t>(lane->buffer.capacity(), buffer_size_);
+  }
+  if (capacity - lane->offset < need) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t n = lane->source->Read(&lane->buffer[lane->offset],
+                                 capacity - lane->offset);
+  if (n > 0) {
+    if (lane->offset == 0)
+      lane->first_time = GetTime();
+    lane->offset += n;
+    lane->bytes += n;
+    lane->read_time = time(NULL);
+    lane->stats->lost = lane->source->Lost();
+    if (!stages_.empty() ||
+        ((express_lane_ >= 0 || stats_.sample_rate < 1000 ||
+          lane->sample < 1000) && !lane->source->Lossless()))
+      ScanRecords(lane);
+  }
   return n;
 }
 
-ssize_t HttpPipe::SendRequest(int fd, bool *finished) {
-  ssize_t res = 0;
-  size_t n = out_length_ - out_offset_;
+void HttpPipe::ScanRecords(Lane *lane) {
+  // the records of a lossless input are neither taken out nor shed
+  bool lossless = lane->source->Lossless();
 
-  if (content_length_ == 0) {
-    if (zip_level_ > 0) {
-      ssize_t save = n;
-      header_->SetField("LETV-ZIP", ZipCompress(&outbuf_, &n) ? "1" : NULL);
-      out_length_ -= save - n;
+  // a batch is sampled at one rate, the one at the time its first record
+  // is scanned
+  if (lane->scanned == 0)
+    lane->sample = lossless ? 1000 : stats_.sample_rate;
+
+  for (size_t i = 0; i < stages_.size(); ++i)
+    RunStage(lane, i);
+
+  Lane *express = express_lane_ >= 0 && !lossless ?
+                  &lanes_[express_lane_] : NULL;
+  char *base = lane->buffer.data();
+  char *p = base + lane->scanned;
+  char *end = base + lane->offset;
+  char *kept = p;  // the other records are moved down to here
+
+  while (p < end) {
+    char *eol = static_cast<char *>(memchr(p, '\n', end - p));
+    if (!eol)
+      break;
+
+    size_t n = eol + 1 - p;
+    size_t key_size;
+    const char *key;
+    bool fast = express && n <= (size_t)express_size_ && IsExpress(p, n);
+    if (fast) {
+      if (express->offset + n > (size_t)express_size_)
+        CutBatch(express);
+      // stays with the others if there is no memory for it
+      fast = pool_.Grow(&express->buffer, express->offset, express_size_);
+    }
+
+    if (fast) {
+      if (express->offset == 0)
+        express->first_time = GetTime();
+      memcpy(&express->buffer[express->offset], p, n);
+      express->offset += n;
+      express->bytes += n;
+      express->read_time = time(NULL);
+    } else if (lane->sample < 1000 &&
+               (key = RecordKey(p, n, &key_size)) &&
+               Hash(key, key_size) % 1000 >= (uint64_t)lane->sample) {
+      ++stats_.shed_records;  // and so is every record of the session
+      stats_.shed_bytes += n;
+    } else {
+      if (kept != p)
+        memmove(kept, p, n);
+      kept += n;
+    }
+    p += n;
+  }
+
+  // the incomplete record is scanned once the rest of it is read
+  memmove(kept, p, end - p);
+  lane->scanned = kept - base;
+  lane->offset = lane->scanned + (end - p);
+
+  // nothing left of what was read, the last batch cut stands for it
+  if (lossless && lane->offset == 0) {
+    deque<Batch *> &unacked = lane->unacked;
+    if (unacked.empty()) {
+      lane->source->Acknowledge(lane->bytes, true);
+    } else {
+      uint64_t end = unacked.back()->end;
+      for (size_t i = unacked.size(); i > 0 && unacked[i - 1]->end == end; --i)
+        unacked[i - 1]->end = lane->bytes;
     }
+  }
+}
+
+void HttpPipe::EmitStages(bool all) {
+  Lane *lane = &lanes_[stage_lane_];
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    Stage *stage = stages_[i];
+    while (lane->offset < (size_t)buffer_size_ && (all || stage->Due() == 0)) {
+      // grown as the buffers of the inputs are
+      size_t capacity = min<size_t>(lane->buffer.capacity(), buffer_size_);
+      if (capacity - lane->offset < MIN_READ &&
+          capacity < (size_t)buffer_size_) {
+        size_t larger = min<size_t>(max<size_t>(capacity * 2,
+                                                lane->offset + MIN_READ),
+                                    buffer_size_);
+        if (pool_.Grow(&lane->buffer, lane->offset, larger))
+          capacity = min<size_t>(lane->buffer.capacity(), buffer_size_);
+      }
+      if (capacity == lane->offset)
+        break;
 
-    snprintf(&hdrbuf_[0], hdrbuf_.capacity(), "%s",
-             header_->Generate(n, &hdr_length_));
-    hdr_offset_ = 0;
-    content_length_backup_ = content_length_ = n;
+      size_t n = stage->Emit(&lane->buffer[lane->offset],
+                             capacity - lane->offset);
+      if (n == 0)
+        break;
+      if (lane->offset == 0)
+        lane->first_time = GetTime();
+      lane->offset += n;
+      lane->bytes += n;
+      lane->read_time = time(NULL);
+    }
+  }
+}
+
+void HttpPipe::RunStage(Lane *lane, size_t i) {
+  char *base = lane->buffer.data();
+  size_t p = lane->scanned;
+  size_t end = lane->offset;
+  size_t done = end;  // the records are complete up to here
+  while (done > p && base[done - 1] != '\n')
+    --done;
+  if (done == p)
+    return;
+
+  Stage *stage = stages_[i];
+  StageStats *stats = &stats_.stages[i];
+  int64_t start = GetTime();
+  size_t growth = stage->Growth();
+  size_t kept = p;  // the records processed are moved down to here
+
+  while (p < done) {
+    const char *eol = static_cast<const char *>(memchr(base + p, '\n',
+                                                       done - p));
+    size_t n = eol + 1 - (base + p);
+    size_t next = p + n;
+    if (kept != p)
+      memmove(base + kept, base + p, n);
+
+    if (next - kept < n + growth) {
+      // the rest is moved up to the end of the buffer at once, the records
+      // grow into the gap from then on; a full buffer grows beyond the
+      // buffer size, up to twice of it
+      size_t limit = 2 * (size_t)buffer_size_;
+      size_t capacity = min<size_t>(lane->buffer.capacity(), limit);
+      if (capacity - end < growth && capacity < limit) {
+        size_t larger = min<size_t>(max<size_t>(capacity * 2, end + growth),
+                                    limit);
+        if (pool_.Grow(&lane->buffer, end, larger)) {
+          capacity = min<size_t>(lane->buffer.capacity(), limit);
+          base = lane->buffer.data();
+        }
+      }
+      size_t up = capacity - end;
+      if (up > 0) {
+        memmove(base + next + up, base + next, end - next);
+        next += up;
+        done += up;
+        end += up;
+      }
+    }
+
+    size_t room = next - kept;
+    size_t m = min(stage->Process(base + kept, n, room), room);
+    ++stats->records;
+    if (m == 0)
+      ++stats->drops;
+    kept += m;
+    p = next;
+  }
+
+  memmove(base + kept, base + p, end - p);
+  lane->offset = kept + (end - p);
+  stats->time += (GetTime() - start) / 1E6;
+}
+
+bool HttpPipe::IsExpress(const char *p, size_t n) const {
+  for (size_t i = 0; i < express_patterns_.size(); ++i) {
+    const char *pattern = express_patterns_[i];
+    if (*pattern == '^') {
+      size_t m = strlen(pattern + 1);
+      if (m <= n && memcmp(p, pattern + 1, m) == 0)
+        return true;
+    } else if (memmem(p, n, pattern, strlen(pattern))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HttpPipe::Takes(const Link &link, const Batch &batch) const {
+  // an express link takes the express batches away from the others
+  return express_link_ && express_lane_ >= 0 ?
+         link.express == batch.express : !link.express;
+}
+
+void HttpPipe::ControlShedding() {
+  int64_t now = GetTime();
+  int64_t elapsed = now - shed_time_;
+  if (!shedding_ || elapsed < 1000000)
+    return;
+
+  // the input kept and the input taken by the links, over the last second
+  uint64_t input = 0;
+  uint64_t output = 0;
+  size_t overflows = 0;
+  size_t backlog = 0;  // of the fullest lane, in 1000
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    const Lane &lane = lanes_[i];
+    output += lane.stats->bytes;
+    if ((int)i == express_lane_ || (int)i == stage_lane_ ||
+        lane.source->Lossless())
+      continue;
+    input += lane.bytes;
+    overflows += lane.stats->overflows;
+    backlog = max<size_t>(backlog, lane.offset * 1000 / buffer_size_);
+  }
+  input -= stats_.shed_bytes;
+
+  int sample = stats_.sample_rate;
+  bool overflowed = overflows > shed_overflows_;
+  if (overflowed ||
+      (backlog >= 500 && input - shed_input_ > output - shed_output_))
+    sample = max(sample / 2, shedding_ * 10);
+  else if (backlog < 250)
+    sample = min<int64_t>(sample + 100 * elapsed / 1000000, 1000);
+
+  if (sample != stats_.sample_rate) {
+    if (sample < stats_.sample_rate)
+      ++stats_.sheds;
+    if (verbose_)
+      log_.Info("* Shedding: sample rate %d/1000 -> %d/1000\n",
+                stats_.sample_rate, sample);
+    stats_.sample_rate = sample;
+  }
+
+  shed_time_ = now;
+  shed_input_ = input;
+  shed_output_ = output;
+  shed_overflows_ = overflows;
+}
+
+int64_t HttpPipe::Resume(const Link &link) const {
+  if (!link.queue.empty() && link.queue.front()->express)
+    return link.express_resume;
+  return link.resume;
+}
+
+ssize_t HttpPipe::SendRequest(Link *link, int fd, size_t limit,
+                              bool *finished) {
+  ssize_t res = 0;
+  const Batch *batch = link->queue.front();
+  size_t n = batch->length - link->out_offset;
+
+  // generated on every (re)send, the destination may have changed
+  if (link->request_state == HTTP_HEAD && link->hdr_offset == 0) {
+    const Destination &d = destinations_[link->active];
+    const Lane &lane = lanes_[batch->lane];
+    header_->SetRequest("POST", lane.path ? lane.path : d.path, "HTTP/1.1");
+    header_->SetField("Host", d.host_field);
+    header_->SetField("LETV-ZIP", batch->zipped ? "1" : NULL);
+    header_->SetField("LETV-Encoding",
+                      batch->encoded ? encoder_->Name() : NULL);
+    header_->SetField("LETV-Source", lane.name);
+    header_->SetField("LETV-Tags", lane.tags);
+    snprintf(sample_field_, sizeof(sample_field_), "%d.%03d",
+             batch->sample / 1000, batch->sample % 1000);
+    header_->SetField("LETV-Sample-Rate",
+                      batch->sample < 1000 ? sample_field_ : NULL);
+    snprintf(&link->hdrbuf[0], link->hdrbuf.capacity(), "%s",
+             header_->Generate(batch->length, &link->hdr_length));
+    link->response_status = 0;
 
     if (verbose_)
-      printf("> HTTP-Request-Header:\n%s", hdrbuf_.data());
+      log_.Info("> HTTP-Request-Header:\n%s", link->hdrbuf.data());
   }
 
-  n = transfer_rate_ > 0 ? min<size_t>(transfer_rate_, n) : n;
+  int rate = batch->express ? express_rate_ : flow_rate_;
+  n = rate > 0 ? min<size_t>(rate, n) : n;
+  n = min(n, limit);
 
-  switch (request_state_) {
+  switch (link->request_state) {
     case HTTP_HEAD:
-      res = SendHead(fd, n);
+      res = SendHead(link, fd, n);
       break;
     case HTTP_BODY:
-      res = SendBody(fd, n);
+      res = SendBody(link, fd, n);
       break;
   }
 
-  if (out_offset_ == out_length_) {
-    request_state_ = HTTP_HEAD;
-    hdr_offset_ = 0;
+  if (link->out_offset == batch->length) {
+    link->request_state = HTTP_HEAD;
+    link->hdr_offset = 0;
     *finished = true;
   } else {
-    request_state_ = HTTP_BODY;
+    link->request_state = HTTP_BODY;
     *finished = false;
   }
   return res;
 }
 
-ssize_t HttpPipe::SendHead(int fd, size_t n) {
+ssize_t HttpPipe::SendHead(Link *link, int fd, size_t n) {
+  Batch *batch = link->queue.front();
   struct iovec iov[2];  // [0]: head, [1]: body
-  iov[0].iov_base = &hdrbuf_[hdr_offset_];
-  iov[0].iov_len = hdr_length_ - hdr_offset_;
-  iov[1].iov_base = &outbuf_[out_offset_];
+  iov[0].iov_base = &link->hdrbuf[link->hdr_offset];
+  iov[0].iov_len = link->hdr_length - link->hdr_offset;
+  iov[1].iov_base = &batch->data[link->out_offset];
   iov[1].iov_len = n;
 
   ssize_t res = writev(fd, iov, 2);
   if (res > 0) {
     if ((size_t)res < iov[0].iov_len) {
-      hdr_offset_ += res;
+      link->hdr_offset += res;
     } else {
       size_t ndata = res - iov[0].iov_len;
-      hdr_offset_ = hdr_length_;
-      out_offset_ += ndata;
+      link->hdr_offset = link->hdr_length;
+      link->out_offset += ndata;
     }
   }
   return res;
 }
 
-ssize_t HttpPipe::SendBody(int fd, size_t n) {
-  ssize_t res = write(fd, &outbuf_[out_offset_], n);
+ssize_t HttpPipe::SendBody(Link *link, int fd, size_t n) {
+  Batch *batch = link->queue.front();
+  ssize_t res = write(fd, &batch->data[link->out_offset], n);
   if (res > 0)
-    out_offset_ += res;
+    link->out_offset += res;
 
   return res;
 }
 
-ssize_t HttpPipe::GetResponse(int fd, bool *finished) {
+ssize_t HttpPipe::GetResponse(Link *link, int fd, bool *finished) {
   ssize_t res;
-  if (response_state_ == HTTP_HEAD) {
-    res = GetHead(fd);
+  if (link->response_state == HTTP_HEAD) {
+    res = GetHead(link, fd);
     if (res <= 0)
       goto finish;
 
-    const char *p = othbuf_.data();
+    const char *p = link->rspbuf.data();
 
     if (verbose_)
-      printf("< HTTP-Response-Header:\n%s\r\n", p);
+      log_.Info("< HTTP-Response-Header:\n%s\r\n", p);
+
+    if (sscanf(p, "%*s%d", &link->response_status) != 1)
+      link->response_status = 0;
+    if (link->response_status / 100 != 2)
+      log_.Warnx("HTTP response exception: %d", link->response_status);
 
-    int status;
-    if (sscanf(p, "%*s%d", &status) == 1 && status / 100 != 2)
-      warnx("HTTP response exception: %d", status);
+    if (flow_control_)
+      ApplyFlowControl(p);
 
-    if ((p = strcasestr(othbuf_.data(), "Content-Length:")) != NULL)
-      content_length_ = strtoul(p + 15, NULL, 10);
+    if ((p = strcasestr(link->rspbuf.data(), "Content-Length:")) != NULL)
+      link->content_length = strtoul(p + 15, NULL, 10);
     else
-      content_length_ = 0;
+      link->content_length = 0;
 
-    persistent_ = true;
-    if ((p = strcasestr(othbuf_.data(), "Connection:")) != NULL) {
+    link->persistent = true;
+    if ((p = strcasestr(link->rspbuf.data(), "Connection:")) != NULL) {
       char token[8];
       if (sscanf(p + 11, " %7[^\r]", token) == 1 &&
           strcasecmp(token, "close") == 0)
-        persistent_ = false;
+        link->persistent = false;
     }
   }
 
-  assert(response_state_ == HTTP_BODY);
-  res = GetBody(fd);
+  assert(link->response_state == HTTP_BODY);
+  res = GetBody(link, fd);
 
 finish:
   if (res == 0 || ILLEGAL(res) ||
-      (response_state_ == HTTP_BODY && content_length_ == 0)) {
-    response_state_ = HTTP_HEAD;
-    hdr_offset_ = 0;
+      (link->response_state == HTTP_BODY && link->content_length == 0)) {
+    link->response_state = HTTP_HEAD;
+    link->hdr_offset = 0;
     *finished = true;
   } else {
     *finished = false;
@@ -389,7 +1576,7 @@ finish:
   return res;
 }
 
-ssize_t HttpPipe::GetHead(int fd) {
+ssize_t HttpPipe::GetHead(Link *link, int fd) {
   int i = 0;
   char s[2] = "";
   ssize_t res = 0;
@@ -403,7 +1590,7 @@ ssize_t HttpPipe::GetHead(int fd) {
       continue;
     } else if (*s == '\n') {
       if (i == 0) {
-        response_state_ = HTTP_BODY;
+        link->response_state = HTTP_BODY;
         break;
       }
       i = 0;
@@ -411,123 +1598,208 @@ ssize_t HttpPipe::GetHead(int fd) {
       ++i;
     }
 
-    if (hdr_offset_ + 2 <= othbuf_.capacity()) {
-      othbuf_[hdr_offset_++] = *s;
-      othbuf_[hdr_offset_] = 0;
+    if (link->hdr_offset + 2 <= link->rspbuf.capacity()) {
+      link->rspbuf[link->hdr_offset++] = *s;
+      link->rspbuf[link->hdr_offset] = 0;
     }
   }
   return res;
 }
 
-ssize_t HttpPipe::GetBody(int fd) {
+ssize_t HttpPipe::GetBody(Link *link, int fd) {
   ssize_t n;
-  while (content_length_ > 0 &&
+  while (link->content_length > 0 &&
          (n = read(fd, &othbuf_[0], othbuf_.capacity())) > 0)
-    content_length_ -= n;
+    link->content_length -= min<size_t>(n, link->content_length);
 
   return read(fd, &othbuf_[0], othbuf_.capacity());  // should be EOF or EAGAIN
 }
 
-void HttpPipe::SetOutput(bool transferable, struct pollfd *pfd) {
+void HttpPipe::SetOutput(Link *link, struct pollfd *pfd) {
+  if (pfd->fd >= 0 && link->connecting &&
+      time(NULL) - link->connect_time >= connect_timeout_) {
+    log_.Warnx("%s: connect to %s timed out", __func__,
+               destinations_[link->active].host_field);
+    link->connecting = false;
+    RecordFailure(link);
+    Rollback(link);
+    RESETFD(pfd->fd);
+  }
+
+  bool transferable = !link->queue.empty() &&
+                      link->http_flow == HTTP_REQUEST &&
+                      Resume(*link) <= GetTime();
   if (transferable) {
     pfd->events |= POLLOUT;
     if (pfd->fd == -1) {
-      pfd->fd = TcpNonBlockConnect(host_, port_);
-      if (pfd->fd == -1)
-        ++connect_retry_n_;
+      UseDestination(link, PickDestination(*link));
+      const Destination &d = destinations_[link->active];
+      pfd->fd = TcpNonBlockConnect(d.host, d.port, &log_);
+      if (pfd->fd == -1) {
+        RecordFailure(link);
+      } else {
+        link->connecting = true;
+        link->connect_time = time(NULL);
+      }
     }
   } else {
     pfd->events &= ~POLLOUT;
   }
 }
 
-void HttpPipe::HandleInput(struct pollfd *pfd) {
-  if (pfd->fd >= 0 && (pfd->revents & (POLLIN | POLLHUP))) {
-    ssize_t n = ReadInput(pfd->fd);
-    if (ILLEGAL(pfd->fd)) {
-      warn("%s: ReadInput error", __func__);
+bool HttpPipe::HasRoom(const Lane &lane) const {
+  // a lossless source waits while its buffer is full, any source while
+  // there is no memory for it
+  if (lane.offset >= (size_t)buffer_size_)
+    return !lane.source->Lossless();
+  if (IsFull(lane))
+    return false;  // too little room for a read, waits for the cut
+  size_t need = NeedRoom(lane);
+  return lane.buffer.capacity() >= lane.offset + need ||
+         pool_.Available(max<size_t>(need, MIN_READ));
+}
+
+size_t HttpPipe::NeedRoom(const Lane &lane) const {
+  return min<size_t>(lane.source->Room(), buffer_size_);
+}
+
+bool HttpPipe::IsFull(const Lane &lane) const {
+  return lane.offset + NeedRoom(lane) > (size_t)buffer_size_;
+}
+
+void HttpPipe::HandleInput(Lane *lane, struct pollfd *pfd) {
+  if (!lane->closed && HasRoom(*lane) &&
+      ((pfd->fd >= 0 && (pfd->revents & (POLLIN | POLLHUP))) ||
+       lane->source->Ready())) {
+    ssize_t n = ReadInput(lane);
+    if (ILLEGAL(n)) {
+      log_.Warn("%s: ReadInput error", __func__);
+      log_.Flush();
       abort();
     } else if (n == 0) {
-      warnx("%s: pipe input encounter EOF", __func__);
+      if (lane->name)
+        log_.Warnx("%s: pipe input %s encounter EOF", __func__, lane->name);
+      else
+        log_.Warnx("%s: pipe input encounter EOF", __func__);
       pfd->fd = -1;
+      lane->closed = true;
     }
   }
 }
 
-void HttpPipe::HandleOutput(struct pollfd *pfd) {
+void HttpPipe::HandleOutput(Link *link, struct pollfd *pfd) {
   assert(header_);
-  HandleHttpResponse(pfd);
-  HandleHttpRequest(pfd);
+  HandleHttpResponse(link, pfd);
+  HandleHttpRequest(link, pfd);
 }
 
-void HttpPipe::HandleHttpResponse(struct pollfd *pfd) {
+void HttpPipe::HandleHttpResponse(Link *link, struct pollfd *pfd) {
   if (pfd->fd >= 0 && (pfd->revents & POLLIN)) {
     bool finished;
-    ssize_t n = GetResponse(pfd->fd, &finished);
-    if (finished)
-      http_flow_ = HTTP_REQUEST;
+    bool answering = link->http_flow == HTTP_RESPONSE;
+    ssize_t n = GetResponse(link, pfd->fd, &finished);
 
     bool illegal = ILLEGAL(n);
     if (illegal) {
-      warn("%s: HttpPipe::GetResponse error", __func__);
-      ++connect_retry_n_;
-      Rollback();
+      log_.Warn("%s: HttpPipe::GetResponse error", __func__);
+      RecordFailure(link);
+      Rollback(link);
+    } else if (finished && answering && link->response_status == 0) {
+      Rollback(link);  // closed without an answer
+    } else if (finished && answering && link->response_status / 100 == 5) {
+      RecordFailure(link);
+      if (PickDestination(*link) != link->active)
+        Rollback(link);  // hand the same batch over to the next destination
+      else
+        FinishBatch(link);
+    } else if (finished && answering) {
+      RecordSuccess(link);
     }
 
-    if (n == 0 || illegal || (finished && !persistent_))
+    if (finished)
+      link->http_flow = HTTP_REQUEST;
+
+    // a recovered destination with higher priority takes over at the
+    // request boundary
+    if (n == 0 || illegal ||
+        (finished &&
+         (!link->persistent || PickDestination(*link) != link->active)))
       RESETFD(pfd->fd);
   }
 }
 
-void HttpPipe::HandleHttpRequest(struct pollfd *pfd) {
-  if (pfd->fd >= 0 && (pfd->revents & POLLOUT)) {
-    connect_retry_n_ = 0;
+void HttpPipe::HandleHttpRequest(Link *link, struct pollfd *pfd) {
+  if (pfd->fd >= 0 && (pfd->revents & POLLOUT) &&
+      link->http_flow == HTTP_REQUEST && !link->queue.empty()) {
+    link->connect_retry_n = 0;
+    link->connecting = false;
+
+    // the bytes the limiter grants, the link waits if none
+    size_t limit = link->queue.front()->length - link->out_offset;
+    if (limiter_) {
+      int64_t wait;
+      limit = limiter_->Take(limit, &wait);
+      if (limit == 0) {
+        bool express = link->queue.front()->express;
+        (express ? link->express_resume : link->resume) = GetTime() + wait;
+        return;
+      }
+    }
 
     bool finished;
-    ssize_t n = SendRequest(pfd->fd, &finished);
-    useconds_t now = GetTime();
+    size_t offset = link->out_offset;
+    ssize_t n = SendRequest(link, pfd->fd, limit, &finished);
+    int64_t now = GetTime();
+    if (limiter_)
+      limiter_->Give(limit - (link->out_offset - offset));
 
     if (n > 0) {
-      double rate = (out_offset_ * 1E6 / (now - milestone)) / transfer_rate_;
-      if (rate > 1) {
-        usleep(1000000);
-        now = GetTime();
+      link->stats->bytes += link->out_offset - offset;
+      stats_.bytes += link->out_offset - offset;
+
+      // hold the link back until the transfer rate allows more, the
+      // express batches have a rate of their own
+      bool express = link->queue.front()->express;
+      int rate = express ? express_rate_ : flow_rate_;
+      if (rate > 0) {
+        int64_t due = link->milestone + link->out_offset * 1000000 / rate;
+        if (due > now)
+          (express ? link->express_resume : link->resume) = due;
       }
 
-      if (verbose_) {
-        printf("\r* Sent: %8zu/%zu  Speed: %8.2f K/s",
-               out_offset_, out_length_,
-               out_offset_ * 1E3 / (now - milestone) * 8);
-        if (finished)
-          putchar('\n');
-        fflush(stdout);
-      }
+      if (verbose_)
+        log_.Info("\r* Sent: %8zu/%zu  Speed: %8.2f K/s%s",
+                  link->out_offset, link->queue.front()->length,
+                  link->out_offset * 1E3 / (now - link->milestone + 1) * 8,
+                  finished ? "\n" : "");
     }
 
     if (finished) {
-      http_flow_ = HTTP_RESPONSE;
-      milestone = now;
+      link->http_flow = HTTP_RESPONSE;
+      link->milestone = now;
     }
 
     if (ILLEGAL(n)) {
-      warn("%s: HttpPipe::SendRequest error", __func__);
-      Rollback();
+      log_.Warn("%s: HttpPipe::SendRequest error", __func__);
+      RecordFailure(link);
+      Rollback(link);
       RESETFD(pfd->fd);
     }
   }
 }
 
-void HttpPipe::HandleError(struct pollfd *pfd) {
+void HttpPipe::HandleError(Link *link, struct pollfd *pfd) {
   if (pfd->fd >=0 && (pfd->revents & POLLERR)) {
     int sockerr = 0;
     socklen_t len = sizeof(sockerr);
     if (getsockopt(pfd->fd, SOL_SOCKET, SO_ERROR, &sockerr, &len))
       sockerr = errno;
     if (sockerr)
-      warnx("%s: poll SO_ERROR: %s", __func__, strerror(sockerr));
+      log_.Warnx("%s: poll SO_ERROR: %s", __func__, strerror(sockerr));
 
-    ++connect_retry_n_;
-    Rollback();
+    link->connecting = false;
+    RecordFailure(link);
+    Rollback(link);
     RESETFD(pfd->fd);
   }
 }
@@ -542,58 +1814,325 @@ void HttpPipe::ParseURL(const char *url) {
     s = url;
   }
 
+  Destination d;
+  memset(&d, 0, sizeof(d));
+
   switch (scheme) {
     case 0:
-      if (sscanf(s, "%63[^:/]:%5[0-9]", host_, port_) == 1)
-        snprintf(port_, sizeof(port_), "80");
-      if (sscanf(s, "%*[^/]%1023s", path_) != 1)
-        snprintf(path_, sizeof(path_), "/");
+      if (sscanf(s, "%63[^:/]:%5[0-9]", d.host, d.port) == 1)
+        snprintf(d.port, sizeof(d.port), "80");
+      if (sscanf(s, "%*[^/]%1023s", d.path) != 1)
+        snprintf(d.path, sizeof(d.path), "/");
       break;
     default:
       errx(1, "unsupported scheme: %s", url);
   }
+
+  snprintf(d.host_field, sizeof(d.host_field), "%s:%s", d.host, d.port);
+  d.state = BREAKER_CLOSED;
+  d.cooldown = breaker_cooldown_;
+  d.routed = false;
+  destinations_.push_back(d);
+}
+
+void HttpPipe::SetupLinks() {
+  bool single = mode_ == MODE_FAILOVER;
+  int n = single ? 1 : destinations_.size();
+
+  // the express link fails over the destinations after the others
+  int express = express_link_ && !express_patterns_.empty() ? 1 : 0;
+
+  links_.resize(n + express);
+  stats_.links.resize(n + express);
+  for (int i = 0; i < n + express; ++i) {
+    Link *link = &links_[i];
+    link->express = i == n;
+    link->first = single || link->express ? 0 : i;
+    link->last = single || link->express ? destinations_.size() : i + 1;
+    link->active = -1;
+    link->hdrbuf.reserve(MAX_QUERY);
+    link->rspbuf.reserve(MAX_QUERY);
+    link->out_offset = 0;
+    link->hdr_offset = 0;
+    link->hdr_length = 0;
+    link->content_length = 0;
+    link->request_state = HTTP_HEAD;
+    link->response_state = HTTP_HEAD;
+    link->http_flow = HTTP_REQUEST;
+    link->response_status = 0;
+    link->connect_retry_n = 0;
+    link->persistent = false;
+    link->connecting = false;
+    link->connect_time = 0;
+    link->milestone = GetTime();
+    link->resume = 0;
+    link->express_resume = 0;
+    link->failover_start = 0;
+    link->stats = &stats_.links[i];
+    link->stats->destination = link->first;
+  }
 }
 
-void HttpPipe::Rollback() {
+int HttpPipe::PickDestination(const Link &link) const {
+  time_t now = time(NULL);
+  int oldest = link.first;
+
+  for (int i = link.first; i < link.last; ++i) {
+    const Destination &d = destinations_[i];
+    switch (d.state) {
+      case BREAKER_CLOSED:
+        return i;
+      case BREAKER_HALF_OPEN:  // the probe is in progress
+        if (i == link.active)
+          return i;
+        break;
+      case BREAKER_OPEN:
+        if (now - d.opened >= d.cooldown)
+          return i;
+        if (d.opened < destinations_[oldest].opened)
+          oldest = i;
+        break;
+    }
+  }
+
+  // all open, retry the one which failed earliest
+  return oldest;
+}
+
+void HttpPipe::UseDestination(Link *link, int i) {
+  Destination *d = &destinations_[i];
+  if (d->state == BREAKER_OPEN)
+    d->state = BREAKER_HALF_OPEN;
+
+  if (i == link->active)
+    return;
+
+  if (link->active >= 0) {
+    ++link->stats->failovers;
+    if (verbose_)
+      log_.Info("* Switching destination: %s -> %s\n",
+                destinations_[link->active].host_field, d->host_field);
+  }
+
+  link->active = link->stats->destination = i;
+}
+
+void HttpPipe::RecordFailure(Link *link) {
+  if (link->active < 0)
+    return;
+
+  Destination *d = &destinations_[link->active];
+  if (d->state == BREAKER_HALF_OPEN)  // failed probe, back off
+    d->cooldown = min(d->cooldown * 2, breaker_cooldown_ * 16);
+  else
+    d->cooldown = breaker_cooldown_;
+  d->state = BREAKER_OPEN;
+  d->opened = time(NULL);
+
+  if (!link->failover_start)
+    link->failover_start = GetTime();
+
+  // only count a retry when there is nowhere else to go
+  int i = link->first;
+  while (i < link->last && destinations_[i].state == BREAKER_OPEN)
+    ++i;
+  if (i == link->last)
+    ++link->connect_retry_n;
+}
+
+void HttpPipe::RecordSuccess(Link *link) {
+  Destination *d = &destinations_[link->active];
+  d->state = BREAKER_CLOSED;
+  d->cooldown = breaker_cooldown_;
+
+  ++link->stats->requests;
+  ++stats_.requests;
+  if (link->failover_start) {
+    link->stats->failover_time = (GetTime() - link->failover_start) / 1E6;
+    link->failover_start = 0;
+  }
+
+  FinishBatch(link);
+}
+
+void HttpPipe::FinishBatch(Link *link) {
+  // answered, on to the next one
+  if (link->response_status / 100 != 2)
+    link->queue.front()->lost = true;
+  ReleaseBatch(link->queue.front());
+  link->queue.pop_front();
+  link->stats->lag = link->queue.size();
+  link->out_offset = 0;
+}
+
+bool HttpPipe::Rollback(Link *link) {
   // there is no response or response error
-  if (content_length_ != 0) {
+  if (link->out_offset > 0 || link->hdr_offset > 0 ||
+      link->http_flow == HTTP_RESPONSE) {
     if (verbose_)
-      printf("* Rolling back: %s, %zu/%zu\n",
-             http_flow_ ?
-               (response_state_ ? "HTTP_RESPONSE, HTTP_BODY" :
-                "HTTP_RESPONSE, HTTP_HEAD") :
-               (request_state_ ? "HTTP_REQUEST, HTTP_BODY" :
-                "HTTP_REQUEST, HTTP_HEAD"),
-             out_offset_, content_length_);
-
-    out_offset_ = out_length_ - content_length_backup_;
-    content_length_ = content_length_backup_;
-    hdr_offset_ = 0;
-    http_flow_ = HTTP_REQUEST;
-    request_state_ = response_state_ = HTTP_HEAD;
-  }
-}
-
-bool HttpPipe::ZipCompress(vector<char> *buffer, size_t *n) {
-  uLongf zn = max<uLongf>(buffer->capacity(), compressBound(*n));
-  othbuf_.reserve(zn);
-
-  int res = compress2((unsigned char *)(othbuf_.data()), &zn,
-                      (const unsigned char *)(buffer->data()), *n, zip_level_);
-  if (res == Z_OK) {
-    buffer->swap(othbuf_);
-    *n = zn;
-  } else if (res == Z_MEM_ERROR) {
-    warnx("%s: Z_MEM_ERROR: out of memory", __func__);
+      log_.Info("* Rolling back: %s, %zu/%zu\n",
+                link->http_flow ?
+                  (link->response_state ? "HTTP_RESPONSE, HTTP_BODY" :
+                   "HTTP_RESPONSE, HTTP_HEAD") :
+                  (link->request_state ? "HTTP_REQUEST, HTTP_BODY" :
+                   "HTTP_REQUEST, HTTP_HEAD"),
+                link->out_offset,
+                link->queue.empty() ? 0 : link->queue.front()->length);
+
+    link->out_offset = 0;
+    link->hdr_offset = 0;
+    link->http_flow = HTTP_REQUEST;
+    link->request_state = link->response_state = HTTP_HEAD;
+    return true;
+  }
+  return false;
+}
+
+void HttpPipe::ApplyFlowControl(const char *head) {
+  const char *p;
+  long value;
+
+  // LETV-Rate: bytes per second, never above the configured rate
+  value = transfer_rate_;
+  if ((p = strcasestr(head, "LETV-Rate:")) != NULL) {
+    value = strtol(p + 10, NULL, 10);
+    value = max<long>(value, min_transfer_rate_);
+    if (transfer_rate_ > 0)
+      value = min<long>(value, transfer_rate_);
+  }
+  flow_rate_ = value;
+
+  // LETV-Batch-Size: bytes to accumulate before an idle transfer
+  value = 0;
+  if ((p = strcasestr(head, "LETV-Batch-Size:")) != NULL)
+    value = min<long>(max(strtol(p + 16, NULL, 10), 0L), buffer_size_);
+  flow_batch_ = value;
+
+  // LETV-Batch-Interval: seconds between idle transfers
+  value = transfer_interval_;
+  if ((p = strcasestr(head, "LETV-Batch-Interval:")) != NULL) {
+    value = strtol(p + 20, NULL, 10);
+    value = max<long>(value, transfer_interval_);
+    value = min<long>(value, max(transfer_interval_, max_transfer_interval_));
+  }
+  flow_interval_ = value;
+
+  // LETV-ZIP-Level: 0 for identity, 1~9 for deflate
+  value = zip_level_;
+  if ((p = strcasestr(head, "LETV-ZIP-Level:")) != NULL)
+    value = min<long>(max(strtol(p + 15, NULL, 10), 0L), max_zip_level_);
+  flow_zip_level_ = value;
+
+  if (verbose_)
+    log_.Info("* Flow: rate %d, batch %zu, interval %d, zip %d\n",
+              flow_rate_, flow_batch_, flow_interval_, flow_zip_level_);
+}
+
+void HttpPipe::ReleaseIdle() {
+  time_t now = time(NULL);
+  if (idle_memory_ <= 0 || now == release_time_)
+    return;
+
+  // memory goes with the inputs in use, not with the number of them, nor
+  // with the peak of them
+  release_time_ = now;
+  time_t before = now - idle_memory_;
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    Lane *lane = &lanes_[i];
+    if (lane->offset == 0 && lane->read_time < before)
+      pool_.Release(&lane->buffer);
+  }
+
+  if (zip_time_ < before) {
+    EndZip();
+    vector<char>().swap(encbuf_);
+#ifdef __GLIBC__
+    malloc_trim(0);  // the heap keeps what is freed otherwise
+#endif
+  }
+
+  size_t n = pool_.Trim(before);
+  if (n > 0 && verbose_)
+    log_.Info("* Gave back %zu bytes left unused\n", n);
+}
+
+void HttpPipe::Encode(Batch *batch) {
+  if (!encoder_ || batch->length == 0)
+    return;
+
+  zip_time_ = time(NULL);
+  encbuf_.clear();
+  Buffer out;
+  if (encoder_->Encode(batch->data.data(), batch->length, &encbuf_) &&
+      pool_.Grow(&out, 0, encbuf_.size())) {
+    memcpy(out.data(), encbuf_.data(), encbuf_.size());
+    batch->data.swap(out);
+    batch->length = encbuf_.size();
+    batch->encoded = true;
+  }
+}
+
+bool HttpPipe::ZipCompress(Buffer *buffer, size_t *n) {
+#ifdef NO_ZIP
+  return false;  // sent as it is
+#else
+  // one deflate state for all batches, rather than one per compress2()
+  if (!zip_stream_) {
+    zip_stream_ = new z_stream;
+    memset(zip_stream_, 0, sizeof(*zip_stream_));
+    int res = deflateInit(zip_stream_, flow_zip_level_);
+    if (res != Z_OK) {
+      log_.Warnx("%s: deflateInit error: %d", __func__, res);
+      delete zip_stream_;
+      zip_stream_ = NULL;
+      return false;
+    }
+    zip_stream_level_ = flow_zip_level_;
+  }
+
+  z_stream *zs = zip_stream_;
+  zip_time_ = time(NULL);
+  deflateReset(zs);
+  if (zip_stream_level_ != flow_zip_level_) {
+    deflateParams(zs, flow_zip_level_, Z_DEFAULT_STRATEGY);
+    zip_stream_level_ = flow_zip_level_;
+  }
+
+  // sent as it is if there is no memory for it
+  Buffer out;
+  if (!pool_.Grow(&out, 0, deflateBound(zs, *n)))
+    return false;
+
+  zs->next_in = (Bytef *)(buffer->data());
+  zs->avail_in = *n;
+  zs->next_out = (Bytef *)(out.data());
+  zs->avail_out = out.capacity();
+
+  int res = deflate(zs, Z_FINISH);
+  if (res == Z_STREAM_END) {
+    buffer->swap(out);
+    *n = zs->total_out;
   } else if (res == Z_BUF_ERROR) {
-    warnx("%s: Z_BUF_ERROR: out of room in the output buffer", __func__);
+    log_.Warnx("%s: Z_BUF_ERROR: out of room in the output buffer",
+               __func__);
   } else if (res == Z_STREAM_ERROR) {
-    warnx("%s: Z_STREAM_ERROR: invalid compress level", __func__);
+    log_.Warnx("%s: Z_STREAM_ERROR: inconsistent stream state", __func__);
   } else {
-    warnx("%s: unknown error", __func__);
+    log_.Warnx("%s: unknown error", __func__);
   }
 
-  return res == Z_OK;
+  return res == Z_STREAM_END;
+#endif  // NO_ZIP
+}
+
+void HttpPipe::EndZip() {
+#ifndef NO_ZIP
+  if (zip_stream_) {
+    deflateEnd(zip_stream_);
+    delete zip_stream_;
+    zip_stream_ = NULL;
+  }
+#endif
 }
 
 }  // namespace v
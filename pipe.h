@@ -6,11 +6,26 @@
 
 #include <poll.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
+#include <unistd.h>
+#include <deque>
 #include <vector>
 
+#include "hashring.h"
+#include "log.h"
+#include "pool.h"
+
+struct z_stream_s;
+
 #define MAX_QUERY  2048
 
+// Features compiled away, e.g. for the small builds of embedded devices,
+// where they are never turned on anyway:
+//   NO_ZIP, the batches are never compressed, and zlib is left out
+//   NO_VERBOSE, the pipe has no verbose output, nor checks for it
+
 #ifdef __ANDROID__
 
 #define err(ret, ...) do { \
@@ -39,8 +54,12 @@
 
 namespace v {
 
+using std::deque;
 using std::vector;
 
+class HttpPipe;
+class Ring;
+
 class Header {
  public:
   virtual ~Header() {}
@@ -51,13 +70,177 @@ class Header {
   virtual const char * Generate(size_t body_size, size_t *head_size) = 0;
 };
 
+// An input of the pipe, its descriptor is polled along with the connections
+class Source {
+ public:
+  virtual ~Source() {}
+  // polled for POLLIN, -1 if there is nothing to wait for
+  virtual int Descriptor() const = 0;
+  // copies up to n bytes of input to buf, returns 0 on EOF, or -1 with
+  // errno EAGAIN if there is nothing to give now
+  virtual ssize_t Read(char *buf, size_t n) = 0;
+  // has input at hand which is read without polling
+  virtual bool Ready() const { return false; }
+  // when the pipe is full, hold the input back rather than overwrite it
+  virtual bool Lossless() const { return false; }
+  // the first offset bytes ever read are delivered (ok), or given up
+  virtual void Acknowledge(uint64_t offset, bool ok) {}
+  // records lost before the pipe could read them, e.g. dropped by the kernel
+  virtual size_t Lost() const { return 0; }
+  // bytes a read needs room for, e.g. the largest datagram; with less room
+  // left the input waits for its buffer to be cut, unless the whole buffer
+  // is smaller
+  virtual size_t Room() const { return 1; }
+  // the log of the pipe, set before the first read, for the messages while
+  // it serves
+  virtual Log * SetLog(Log *p) { return NULL; }
+};
+
+// A step the records of the inputs go through on their way to the batches,
+// e.g. a filter, run in place in the buffer of an input, so a record left
+// as it is is never copied
+class Stage {
+ public:
+  virtual ~Stage() {}
+  // the record at p, n bytes ending with '\n', is left as it is, rewritten
+  // in place up to room bytes, still ending with '\n', or dropped; returns
+  // its length then, 0 if dropped
+  virtual size_t Process(char *p, size_t n, size_t room) = 0;
+  // bytes a record may grow by at most, room is made for it beforehand
+  virtual size_t Growth() const { return 0; }
+  // counters of its own, after the stats of the pipe
+  virtual void DumpStats(FILE *fp) const {}
+  // records of its own for the pipe, e.g. the ones it rolled up, due in
+  // the microseconds returned, 0 if now, -1 if it has none
+  virtual int64_t Due() const { return -1; }
+  // copies whole records of its own up to n bytes to buf, returns the
+  // bytes copied; asked once due, and once the inputs end whatever is due
+  virtual size_t Emit(char *buf, size_t n) { return 0; }
+};
+
+// Shares a transfer rate with others, on top of the rate of the pipe
+class Limiter {
+ public:
+  virtual ~Limiter() {}
+  // grants up to n bytes to send now, if none, *wait is the microseconds to
+  // wait before asking again
+  virtual size_t Take(size_t n, int64_t *wait) = 0;
+  // returns the bytes granted but not sent
+  virtual void Give(size_t n) {}
+};
+
+// Encodes the records of a batch before it is compressed, e.g. into columns
+class Encoder {
+ public:
+  virtual ~Encoder() {}
+  // appends the encoding of the n bytes of records at p to out, false to
+  // send the batch as it is
+  virtual bool Encode(const char *p, size_t n, vector<char> *out) = 0;
+  // the LETV-Encoding of the batches encoded
+  virtual const char * Name() const = 0;
+  // counters of its own, after the stats of the pipe
+  virtual void DumpStats(FILE *fp) const {}
+};
+
+// Commands for the pipe while it serves, e.g. of a local socket, its
+// descriptor is polled along with the connections
+class Control {
+ public:
+  virtual ~Control() {}
+  // polled for POLLIN, -1 if there is nothing to wait for
+  virtual int Descriptor() const = 0;
+  // has commands at hand which are run without polling, e.g. of a reload
+  virtual bool Ready() const { return false; }
+  // runs the commands at hand, by the setting methods of the pipe
+  virtual void Run(HttpPipe *pipe) = 0;
+  // the log of the pipe, as for Source
+  virtual Log * SetLog(Log *p) { return NULL; }
+};
+
+class FdSource : public Source {
+ public:
+  explicit FdSource(int fd = STDIN_FILENO);
+
+  int SetFd(int fd);
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+
+ private:
+  int fd_;
+};
+
+struct LinkStats {
+  int destination;       // index of the active destination
+  size_t requests;       // requests answered by the server
+  size_t bytes;          // request body bytes sent
+  size_t lag;            // batches waiting for this link
+  size_t drops;          // batches skipped to keep the lag bounded
+  size_t failovers;      // times the active destination changed
+  double failover_time;  // seconds the last failover took
+};
+
+struct SourceStats {
+  const char *name;
+  size_t batches;        // batches cut from this input
+  size_t bytes;          // input bytes in them
+  size_t overflows;      // times the buffer was full and overwritten
+  double max_wait;       // seconds the oldest byte of a batch waited, at most
+  size_t lost;           // records lost by the input itself, see Source
+};
+
+struct StageStats {
+  const char *name;
+  size_t records;        // records given to the stage
+  size_t drops;          // records dropped by it
+  double time;           // seconds spent in it
+};
+
+struct Stats {
+  size_t batches;        // batches cut from the input
+  size_t requests;       // summed over links
+  size_t bytes;          // summed over links
+  vector<LinkStats> links;
+  vector<SourceStats> sources;
+  vector<StageStats> stages;
+  int sample_rate;       // records kept in 1000 by overload shedding
+  size_t shed_records;   // records dropped by overload shedding
+  size_t shed_bytes;
+  size_t sheds;          // times the sample rate was lowered
+};
+
 class HttpPipe {
  public:
+  // How the destinations are used:
+  //   MODE_FAILOVER, one connection walking down the list on failures
+  //   MODE_REPLICATE, one connection per destination, each batch to all
+  //   MODE_ROUTE, one connection per destination, each record to the one
+  //     owning its key on a consistent hash ring; the keys of a destination
+  //     whose breaker is open go to the others until it cools down
+  enum Mode { MODE_FAILOVER, MODE_REPLICATE, MODE_ROUTE };
+
   HttpPipe();
+  ~HttpPipe();
 
   void Init(int infd, const char *outurl);
   void Serve(int timeout);
 
+  // In-process input: instead of the descriptor of Init(), takes the
+  // records that any threads Write(), or Reserve() and Commit(), while
+  // Serve() runs, through a lock-free ring of the size given; a record
+  // without room is refused with false or NULL
+  bool InitRing(size_t size);
+  bool Write(const void *p, size_t n);
+  void * Reserve(size_t n);
+  void Commit(void *p);
+
+  // Destinations are used in the order added, the first one is given by
+  // Init(), a failed destination is skipped until its breaker cools down
+  void AddDestination(const char *url);
+
+  const Stats & GetStats() const;
+  void DumpStats(FILE *fp) const;
+
   // Setting methods:
   //   set property and returns previous one
   //   specially, the parameter -1/NULL do not change the value
@@ -71,32 +254,263 @@ class HttpPipe {
   int SetVerbose(int n);
   Header * SetHeader(Header *p);
 
+  // The verbose output and the warnings of the serving pipe are kept in a
+  // log, written out as standard output and error take them, so neither
+  // holds the transfers back; n messages a second per level at most, 0
+  // for no bound
+  int SetLogRate(int n);
+
+  // Server-driven flow control:
+  //   the collector may attach LETV-Rate, LETV-Batch-Size,
+  //   LETV-Batch-Interval and LETV-ZIP-Level to its responses, each hint is
+  //   clamped to the local bounds below and dropped once the server stops
+  //   sending it
+  int SetFlowControl(int n);
+  int SetMinTransferRate(int n);
+  int SetMaxTransferInterval(int n);
+  int SetMaxZipLevel(int n);
+
+  int SetConnectTimeout(int n);
+  int SetBreakerCooldown(int n);
+  bool * SetDumpFlag(bool *p);
+
+  int SetMode(int n);
+  int SetMaxLag(int n);  // batches a replica may fall behind
+
+  // Routing key of a record (a line), either a field split by the
+  // delimiter, counted from 1, or a fixed range of bytes if the length is
+  // positive
+  int SetKeyField(int n);
+  int SetKeyDelimiter(int c);
+  int SetKeyOffset(int n);
+  int SetKeyLength(int n);
+
+  // Reads from the source instead of the descriptor given by Init()
+  Source * SetSource(Source *p);
+
+  // Fans in another input, its batches are posted to path (the one of the
+  // destination if NULL) with the LETV-Source and LETV-Tags fields set to
+  // name and tags unless NULL; the connections, the compressor and the
+  // spare batches are shared by all inputs, and the ones added replace
+  // the single input of Init() or SetSource(); returns the index of it
+  int AddSource(Source *source, const char *name, const char *path,
+                const char *tags);
+
+  // Scheduling of the input i, as the setting methods above:
+  //   the inputs take the links by deficit round-robin, a busy input is
+  //   served weight times as much as an input of weight 1; rate caps the
+  //   bytes per second taken from it, 0 for no cap; an input of positive
+  //   latency is due within that many seconds of its oldest byte and goes
+  //   ahead of the others once it is late
+  int SetSourceWeight(int i, int n);
+  int SetSourceRate(int i, int n);
+  int SetSourceLatency(int i, int n);
+
+  // Express lane:
+  //   a record (a line) of an input starting with a pattern given as
+  //   "^PREFIX", or containing any other pattern, is taken out into a small
+  //   lane of its own, cut at once and queued ahead of the bulk batches at
+  //   the next request boundary; it is paced by its own rate, 0 for none,
+  //   and with a link of its own never waits behind a bulk upload; records
+  //   of a lossless input stay where they are, to keep its acknowledgements
+  //   in order
+  void AddExpressPattern(const char *pattern);
+  int SetExpressSize(int n);
+  int SetExpressRate(int n);
+  int SetExpressLink(int n);
+
+  // Overload shedding:
+  //   while the input outgrows the links, the records of the lossy inputs
+  //   are sampled at ingest rather than overwritten in bulk, the ones of a
+  //   session, i.e. of the same routing key, kept or dropped together; the
+  //   sample rate is halved on overload, down to n percent, and restored
+  //   step by step once the backlog is gone, and every batch carries the
+  //   rate it was sampled at as LETV-Sample-Rate; 0 disables it
+  int SetShedding(int n);
+
+  // Stages:
+  //   the records of every input go through the stages in the order added
+  //   as they are read, before the express lane, the shedding and the
+  //   batches; a record dropped by a lossless input is acknowledged along
+  //   with the records after it; the records a stage emits of its own go
+  //   into a lane of the stages; the time of each stage is in the stats
+  //   under its name; returns the index of it
+  int AddStage(Stage *stage, const char *name);
+
+  // Asks the limiter before sending any request body bytes
+  Limiter * SetLimiter(Limiter *p);
+
+  // Memory of the inputs and the batches:
+  //   the buffers are segments of a pool, recycled rather than freed and
+  //   never zeroed, and the segments mapped are at most n bytes, 0 for no
+  //   bound; once there is no memory left an input is held back, and a
+  //   batch is sent without being compressed or encoded; the prefault maps
+  //   and faults in a buffer of every input and of a batch in flight
+  //   before the first one is read, and is kept; the memory left unused for
+  //   the idle seconds, the buffers, the compressor and the pool, is given
+  //   back to the system, 0 to keep it; the buffers of 2 MB and up may be
+  //   of huge pages, and all of them locked in memory
+  int SetMemoryLimit(int n);
+  int SetPrefault(int n);
+  int SetIdleMemory(int n);
+  int SetHugePages(int n);
+  int SetLockMemory(int n);
+
+  // Encodes every batch before it is compressed, the ones encoded are sent
+  // with the LETV-Encoding field set to the name of the encoder
+  Encoder * SetEncoder(Encoder *p);
+
+  // Runtime control:
+  //   the commands of the control are run in between two turns of the
+  //   loop, never in the middle of a batch, so the setting methods take
+  //   effect with the next batch; the transfer rate, interval and ZIP level
+  //   set while serving stand for the hints of the server until its next
+  //   response; the transfer interval is the one of Serve() until set; a
+  //   destination added while serving joins the failover list
+  Control * SetControl(Control *p);
+  int SetTransferInterval(int n);
+
  private:
   enum HttpState { HTTP_HEAD, HTTP_BODY };
   enum HttpFlow { HTTP_REQUEST, HTTP_RESPONSE };
+  enum BreakerState { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+
+  struct Destination {
+    char host[64];
+    char port[6];
+    char path[1024];
+    char host_field[70];
+    BreakerState state;
+    int cooldown;  // seconds to stay open before the next probe
+    time_t opened;
+    bool routed;   // owns its points on the ring, MODE_ROUTE
+  };
+
+  // a piece of input, compressed at most once and shared by every link
+  // delivering it
+  struct Batch {
+    Buffer data;
+    size_t length;
+    bool zipped;
+    bool encoded;
+    int refs;
+    int lane;      // cut from
+    uint64_t end;  // input offset right after the batch
+    bool lost;     // not delivered to some link
+    bool done;
+    bool express;
+    int sample;    // records kept in 1000
+  };
 
-  int CheckTransfer(int *idle_transfer_n, int *busy_transfer_n);
-  ssize_t ReadInput(int fd);
-  ssize_t SendRequest(int fd, bool *finished);
-  ssize_t SendHead(int fd, size_t n);
-  ssize_t SendBody(int fd, size_t n);
-  ssize_t GetResponse(int fd, bool *finished);
-  ssize_t GetHead(int fd);
-  ssize_t GetBody(int fd);
-  void SetOutput(bool transferable, struct pollfd *pfd);
-  void HandleInput(struct pollfd *pfd);
-  void HandleOutput(struct pollfd *pfd);
-  void HandleHttpRequest(struct pollfd *pfd);
-  void HandleHttpResponse(struct pollfd *pfd);
-  void HandleError(struct pollfd *pfd);
+  // an input with the batches cut from it
+  struct Lane {
+    Source *source;
+    const char *name;
+    const char *path;
+    const char *tags;
+    Buffer buffer;        // grown on demand, released once idle
+    size_t offset;
+    size_t scanned;       // for express and shed records, up to the offset
+    bool closed;          // nothing more to read
+    time_t read_time;     // something was read last at
+    uint64_t bytes;       // read from the source so far
+    time_t batch_time;
+    int idle_n;           // transfers in this interval
+    int busy_n;
+    deque<Batch *> unacked;  // in the order cut, until acknowledged
+    int64_t first_time;   // the oldest byte buffered was read at
+    int weight;
+    int rate;
+    int latency;
+    size_t deficit;       // bytes earned by round-robin, not yet taken
+    int64_t allowance;    // bytes the rate cap lets through now
+    int64_t refill_time;
+    bool due;
+    bool overflowed;      // since the last batch, so it is busy anyway
+    int sample;           // of the records buffered, in 1000
+    SourceStats *stats;
+  };
+
+  // a connection to the first usable one of destinations [first, last)
+  struct Link {
+    int first;
+    int last;
+    int active;
+    deque<Batch *> queue;  // the front one is in transfer
+    vector<char> hdrbuf;   // request head
+    vector<char> rspbuf;   // response head
+    size_t out_offset;
+    size_t hdr_offset;
+    size_t hdr_length;
+    size_t content_length;  // of the response body
+    HttpState request_state;
+    HttpState response_state;
+    HttpFlow http_flow;
+    int response_status;
+    int connect_retry_n;
+    bool persistent;
+    bool connecting;
+    time_t connect_time;
+    int64_t milestone;
+    int64_t resume;  // held back by the transfer rate until
+    int64_t express_resume;  // same, by the express rate
+    int64_t failover_start;
+    bool express;    // takes nothing but express batches
+    LinkStats *stats;
+  };
+
+  int CheckTransfer();
+  bool IsDue(const Lane &lane, int64_t now) const;
+  Lane * PickLane();
+  void ScanRecords(Lane *lane);
+  void RunStage(Lane *lane, size_t i);
+  void EmitStages(bool all);
+  bool IsExpress(const char *p, size_t n) const;
+  bool Takes(const Link &link, const Batch &batch) const;
+  int64_t Resume(const Link &link) const;
+  void ControlShedding();
+  void CutBatch(Lane *lane);
+  void RouteBatch(Lane *lane);
+  void UpdateRing();
+  Batch * AllocBatch(Lane *lane, size_t capacity);
+  void QueueBatch(Link *link, Batch *batch);
+  void ReleaseBatch(Batch *batch);
+  void AcknowledgeBatches(Lane *lane);
+  const char * RecordKey(const char *p, size_t n, size_t *key_size) const;
+  ssize_t ReadInput(Lane *lane);
+  ssize_t SendRequest(Link *link, int fd, size_t limit, bool *finished);
+  ssize_t SendHead(Link *link, int fd, size_t n);
+  ssize_t SendBody(Link *link, int fd, size_t n);
+  ssize_t GetResponse(Link *link, int fd, bool *finished);
+  ssize_t GetHead(Link *link, int fd);
+  ssize_t GetBody(Link *link, int fd);
+  void SetOutput(Link *link, struct pollfd *pfd);
+  void HandleInput(Lane *lane, struct pollfd *pfd);
+  void HandleOutput(Link *link, struct pollfd *pfd);
+  void HandleHttpRequest(Link *link, struct pollfd *pfd);
+  void HandleHttpResponse(Link *link, struct pollfd *pfd);
+  void HandleError(Link *link, struct pollfd *pfd);
   void ParseURL(const char *url);
-  void Rollback();
-  bool ZipCompress(vector<char> *buffer, size_t *n);
+  void SetupLinks();
+  int PickDestination(const Link &link) const;
+  void UseDestination(Link *link, int i);
+  void RecordFailure(Link *link);
+  void RecordSuccess(Link *link);
+  void FinishBatch(Link *link);
+  bool Rollback(Link *link);
+  void ApplyFlowControl(const char *head);
+  void Encode(Batch *batch);
+  bool ZipCompress(Buffer *buffer, size_t *n);
+  void EndZip();
+  bool HasRoom(const Lane &lane) const;
+  size_t NeedRoom(const Lane &lane) const;
+  bool IsFull(const Lane &lane) const;
+  void ReleaseIdle();
 
-  vector<char> inbuf_;
-  vector<char> outbuf_;
-  vector<char> hdrbuf_;
-  vector<char> othbuf_;  // other buffer, for ZIP or receiving response
+  BufferPool pool_;      // before the buffers, so it outlives them
+  Log log_;
+  vector<char> othbuf_;  // other buffer, for receiving response
+  vector<char> encbuf_;  // of the encoder
 
   int buffer_size_;
   int connect_retry_;
@@ -105,27 +519,65 @@ class HttpPipe {
   bool *stop_flag_;
   int transfer_rate_;
   int zip_level_;
+#ifdef NO_VERBOSE
+  static const int verbose_ = 0;  // the output is dropped by the compiler
+#else
   int verbose_;
+#endif
   Header *header_;
+  int flow_control_;
+  int min_transfer_rate_;
+  int transfer_interval_;
+  int max_transfer_interval_;
+  int max_zip_level_;
+  int connect_timeout_;
+  int breaker_cooldown_;
+  bool *dump_flag_;
+  int mode_;
+  int max_lag_;
+  int key_field_;
+  int key_delimiter_;
+  int key_offset_;
+  int key_length_;
+  vector<const char *> express_patterns_;
+  int express_size_;
+  int express_rate_;
+  int express_link_;
+  int shedding_;
+  Limiter *limiter_;
+  Encoder *encoder_;
+  Control *control_;
+  int prefault_;
+  int idle_memory_;
+  vector<Stage *> stages_;
+
+  // effective values, i.e. the configured ones adjusted by server hints
+  int flow_rate_;
+  size_t flow_batch_;
+  int flow_interval_;
+  int flow_zip_level_;
 
-  size_t in_offset_;
-  size_t out_offset_;
-  size_t out_length_;  // total data to transfer
-  size_t hdr_offset_;
-  size_t hdr_length_;
-  size_t content_length_;
-  size_t content_length_backup_;
-  useconds_t milestone;
-
-  int infd_;
-  char host_[64];
-  char port_[6];
-  char path_[1024];
-  HttpState request_state_;
-  HttpState response_state_;
-  HttpFlow http_flow_;
-  int connect_retry_n_;
-  bool persistent_;
+  FdSource input_;
+  Ring *inbox_;  // of Write(), NULL until InitRing()
+  Source *source_;
+  vector<Lane> lanes_;
+  size_t next_lane_;  // the first one to ask for a batch
+  int express_lane_;  // -1 if none
+  int stage_lane_;    // -1 if none
+  int64_t shed_time_;  // the controller looked at the lanes last
+  uint64_t shed_input_;
+  uint64_t shed_output_;
+  size_t shed_overflows_;
+  char sample_field_[16];
+  vector<Destination> destinations_;
+  vector<Link> links_;
+  vector<Batch *> spare_;  // delivered batches for reuse
+  struct z_stream_s *zip_stream_;  // reset for every batch
+  int zip_stream_level_;
+  time_t zip_time_;      // a batch was compressed or encoded last at
+  time_t release_time_;  // the memory left unused was looked at
+  HashRing ring_;
+  Stats stats_;
 };
 
 }  // namespace v
@@ -0,0 +1,255 @@
+// pool.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "pool.h"
+
+#include <assert.h>
+#include <err.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <algorithm>
+
+#define HUGE_CLASS  21  // of 2 MB, a huge page
+
+namespace v {
+
+Buffer::Buffer()
+    : data_(NULL),
+      capacity_(0),
+      pool_(NULL) {
+  // empty
+}
+
+Buffer::Buffer(const Buffer &other)
+    : data_(NULL),
+      capacity_(0),
+      pool_(NULL) {
+  assert(!other.data_);
+}
+
+Buffer::~Buffer() {
+  if (pool_)
+    pool_->Release(this);
+}
+
+void Buffer::swap(Buffer &other) {
+  std::swap(data_, other.data_);
+  std::swap(capacity_, other.capacity_);
+  std::swap(pool_, other.pool_);
+}
+
+BufferPool::BufferPool()
+    : limit_(0),
+      huge_pages_(0),
+      lock_memory_(0),
+      mapped_(0),
+      reserved_(0),
+      used_(0),
+      peak_(0),
+      maps_(0),
+      unmaps_(0),
+      reuses_(0),
+      fails_(0) {
+  // empty
+}
+
+BufferPool::~BufferPool() {
+  // the buffers in use go with the pipe, before the pool
+  for (int k = MIN_CLASS; k <= MAX_CLASS; ++k)
+    for (size_t i = 0; i < free_[k].size(); ++i)
+      Unmap(free_[k][i].data, k);
+}
+
+size_t BufferPool::SetLimit(size_t n) {
+  size_t old = limit_;
+  if (n != (size_t)-1)
+    limit_ = n;
+  return old;
+}
+
+int BufferPool::SetHugePages(int n) {
+  int old = huge_pages_;
+  if (n >= 0)
+    huge_pages_ = n;
+  return old;
+}
+
+int BufferPool::SetLockMemory(int n) {
+  int old = lock_memory_;
+  if (n >= 0)
+    lock_memory_ = n;
+  return old;
+}
+
+bool BufferPool::Grow(Buffer *buffer, size_t used, size_t n) {
+  if (buffer->capacity_ >= n)
+    return true;
+
+  int k = ClassOf(n);
+  if (k < 0) {
+    ++fails_;
+    return false;
+  }
+
+  // the smallest free segment large enough, or a new one
+  char *p = NULL;
+  int j = k;
+  for (; j <= MAX_CLASS; ++j) {
+    if (!free_[j].empty()) {
+      p = free_[j].back().data;
+      free_[j].pop_back();
+      ++reuses_;
+      break;
+    }
+  }
+  if (!p) {
+    j = k;
+    if (!MakeRoom((size_t)1 << k) || !(p = Map(k))) {
+      ++fails_;
+      return false;
+    }
+  }
+
+  used_ += (size_t)1 << j;
+  peak_ = std::max(peak_, used_);
+  if (used > 0)
+    memcpy(p, buffer->data_, used);
+  Release(buffer);
+  buffer->data_ = p;
+  buffer->capacity_ = (size_t)1 << j;
+  buffer->pool_ = this;
+  return true;
+}
+
+void BufferPool::Release(Buffer *buffer) {
+  if (!buffer->data_)
+    return;
+
+  assert(buffer->pool_ == this);
+  Segment segment = { buffer->data_, time(NULL) };
+  free_[ClassOf(buffer->capacity_)].push_back(segment);
+  used_ -= buffer->capacity_;
+  buffer->data_ = NULL;
+  buffer->capacity_ = 0;
+  buffer->pool_ = NULL;
+}
+
+bool BufferPool::Available(size_t n) const {
+  int k = ClassOf(n);
+  if (k < 0)
+    return false;
+  for (int j = k; j <= MAX_CLASS; ++j)
+    if (!free_[j].empty())
+      return true;
+
+  // the free segments are unmapped to make room
+  return !limit_ || used_ + ((size_t)1 << k) <= limit_;
+}
+
+size_t BufferPool::Reserve(size_t n, size_t count) {
+  int k = ClassOf(n);
+  if (k < 0)
+    return 0;
+
+  size_t i = 0;
+  for (; i < count; ++i) {
+    if (limit_ && mapped_ + ((size_t)1 << k) > limit_)
+      break;
+    Segment segment = { Map(k), time(NULL) };
+    if (!segment.data)
+      break;
+    free_[k].push_back(segment);
+    reserved_ += (size_t)1 << k;
+  }
+  return i;
+}
+
+size_t BufferPool::Trim(time_t before) {
+  size_t mapped = mapped_;
+  for (int k = MAX_CLASS; k >= MIN_CLASS; --k) {
+    std::vector<Segment> &segments = free_[k];
+    size_t n = 0;
+    while (n < segments.size() && segments[n].since < before &&
+           mapped_ - ((size_t)1 << k) >= reserved_)
+      Unmap(segments[n++].data, k);
+    segments.erase(segments.begin(), segments.begin() + n);
+  }
+  return mapped - mapped_;
+}
+
+size_t BufferPool::Mapped() const {
+  return mapped_;
+}
+
+size_t BufferPool::Used() const {
+  return used_;
+}
+
+void BufferPool::DumpStats(FILE *fp) const {
+  fprintf(fp, "memory: mapped %zu, used %zu, peak %zu, limit %zu, maps %zu, "
+          "unmaps %zu, reuses %zu, fails %zu\n", mapped_, used_, peak_,
+          limit_, maps_, unmaps_, reuses_, fails_);
+}
+
+int BufferPool::ClassOf(size_t n) {
+  int k = MIN_CLASS;
+  while (k <= MAX_CLASS && ((size_t)1 << k) < n)
+    ++k;
+  return k <= MAX_CLASS ? k : -1;
+}
+
+char * BufferPool::Map(int k) {
+  size_t n = (size_t)1 << k;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_POPULATE
+  flags |= MAP_POPULATE;  // faulted in now, rather than when written
+#endif
+
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (huge_pages_ && k >= HUGE_CLASS)
+    p = mmap(NULL, n, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1, 0);
+#endif
+  if (p == MAP_FAILED) {
+    p = mmap(NULL, n, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+      warn("%s: mmap(%zu) error", __func__, n);
+      return NULL;
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge_pages_ && k >= HUGE_CLASS)
+      madvise(p, n, MADV_HUGEPAGE);
+#endif
+  }
+
+  if (lock_memory_ && mlock(p, n) == -1) {
+    warn("%s: mlock(%zu) error, not locking any more", __func__, n);
+    lock_memory_ = 0;
+  }
+
+  mapped_ += n;
+  ++maps_;
+  return static_cast<char *>(p);
+}
+
+void BufferPool::Unmap(char *p, int k) {
+  size_t n = (size_t)1 << k;
+  munmap(p, n);
+  mapped_ -= n;
+  ++unmaps_;
+}
+
+bool BufferPool::MakeRoom(size_t n) {
+  if (!limit_)
+    return true;
+
+  for (int k = MAX_CLASS; k >= MIN_CLASS && mapped_ + n > limit_; --k) {
+    while (!free_[k].empty() && mapped_ + n > limit_) {
+      Unmap(free_[k].back().data, k);
+      free_[k].pop_back();
+    }
+  }
+  return mapped_ + n <= limit_;
+}
+
+}  // namespace v
@@ -0,0 +1,113 @@
+// pool.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <vector>
+
+namespace v {
+
+class BufferPool;
+
+// Bytes of a pool, the ones of a batch or an input; they are never zeroed,
+// the used ones are told by the owner, and go back to the pool with the
+// buffer
+class Buffer {
+ public:
+  Buffer();
+  Buffer(const Buffer &other);  // of an empty one only, e.g. in a vector
+  ~Buffer();
+
+  char * data() const { return data_; }
+  size_t capacity() const { return capacity_; }
+  char & operator[](size_t i) { return data_[i]; }
+  void swap(Buffer &other);
+
+ private:
+  friend class BufferPool;
+
+  Buffer & operator=(const Buffer &other);
+
+  char *data_;
+  size_t capacity_;
+  BufferPool *pool_;  // taken from
+};
+
+// Hands out segments of a power of 2 bytes, of 64 KB at least, each mapped
+// on its own and recycled by a free list of its size, so the memory is
+// faulted in once rather than in the first burst of every batch; a request
+// takes the smallest free segment large enough, a new one is mapped only if
+// there is none. The segments mapped are bounded by the limit: the free
+// ones are unmapped, the largest first, to make room, and past that a
+// request fails, for the pipe to hold the input back, overwrite it or send
+// a batch as it is.
+//
+// The free segments are unmapped once they are left unused for a while,
+// the ones reserved up front aside, so an idle pipe gives its memory back
+// to the system. Segments of 2 MB and up are backed by huge pages if asked
+// for, reserved ones if any, transparent ones otherwise; every segment is
+// locked in memory if asked for.
+class BufferPool {
+ public:
+  BufferPool();
+  ~BufferPool();
+
+  // as the setting methods of the pipe
+  size_t SetLimit(size_t n);  // bytes mapped at most, 0 for no bound
+  int SetHugePages(int n);
+  int SetLockMemory(int n);
+
+  // grows the buffer to n bytes at least, keeping the first used ones,
+  // false if the limit is reached
+  bool Grow(Buffer *buffer, size_t used, size_t n);
+  // takes the segment of the buffer back
+  void Release(Buffer *buffer);
+  // a request of n bytes would be granted
+  bool Available(size_t n) const;
+  // maps and faults in count free segments of n bytes, as the limit lets,
+  // returns the ones mapped
+  size_t Reserve(size_t n, size_t count);
+  // unmaps the segments free since before the time, but the bytes
+  // reserved, returns the bytes unmapped
+  size_t Trim(time_t before);
+
+  size_t Mapped() const;
+  size_t Used() const;
+  void DumpStats(FILE *fp) const;
+
+ private:
+  enum { MIN_CLASS = 16, MAX_CLASS = 40 };  // of 64 KB to 1 TB
+
+  struct Segment {
+    char *data;
+    time_t since;  // free
+  };
+
+  static int ClassOf(size_t n);
+  char * Map(int k);
+  void Unmap(char *p, int k);
+  bool MakeRoom(size_t n);
+
+  size_t limit_;
+  int huge_pages_;
+  int lock_memory_;
+  // by the class, 2^k bytes, the ones freed last at the back
+  std::vector<Segment> free_[MAX_CLASS + 1];
+  size_t mapped_;
+  size_t reserved_;
+  size_t used_;
+  size_t peak_;
+  size_t maps_;
+  size_t unmaps_;
+  size_t reuses_;
+  size_t fails_;
+};
+
+}  // namespace v
+
+#endif  // POOL_H_
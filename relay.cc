@@ -0,0 +1,495 @@
+// relay.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "relay.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+enum { EPOLLIN = 0x001, EPOLLOUT = 0x004 };
+#endif
+#ifndef NO_ZIP
+#include <zlib.h>
+#endif
+#include <algorithm>
+#include <vector>
+
+using std::min;
+using std::vector;
+
+namespace {
+
+bool ZipDecompress(const vector<char> &in, vector<char> *out) {
+#ifdef NO_ZIP
+  return false;  // refused as if corrupted
+#else
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  if (inflateInit(&zs) != Z_OK)
+    return false;
+
+  out->resize(in.size() * 4 + 1024);
+  zs.next_in = (Bytef *)(in.data());
+  zs.avail_in = in.size();
+
+  int res;
+  do {
+    if (zs.total_out == out->size())
+      out->resize(out->size() * 2);
+    zs.next_out = (Bytef *)(&(*out)[zs.total_out]);
+    zs.avail_out = out->size() - zs.total_out;
+    res = inflate(&zs, Z_NO_FLUSH);
+  } while (res == Z_OK);
+
+  out->resize(zs.total_out);
+  inflateEnd(&zs);
+  return res == Z_STREAM_END;
+#endif  // NO_ZIP
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+Relay::Relay()
+    : listen_fd_(-1),
+      epoll_fd_(-1),
+      max_body_(16777216),  // 16M
+#ifndef NO_VERBOSE
+      verbose_(0),
+#endif
+      log_(NULL),
+      read_bytes_(0),
+      ready_(),
+      waiting_(),
+      clients_(0) {
+  // empty
+}
+
+Relay::~Relay() {
+  for (size_t i = 0; i < ready_.size(); ++i)
+    delete ready_[i];
+  for (size_t i = 0; i < waiting_.size(); ++i)
+    delete waiting_[i];
+  if (epoll_fd_ >= 0)
+    close(epoll_fd_);
+  if (listen_fd_ >= 0)
+    close(listen_fd_);
+}
+
+int Relay::SetMaxBody(int n) {
+  int old = max_body_;
+  if (n >= 0)
+    max_body_ = n;
+  return old;
+}
+
+int Relay::SetVerbose(int n) {
+  int old = verbose_;
+#ifndef NO_VERBOSE
+  if (n >= 0)
+    verbose_ = n;
+#endif
+  return old;
+}
+
+int Relay::Descriptor() const {
+  return epoll_fd_;
+}
+
+bool Relay::Ready() const {
+  return !ready_.empty();
+}
+
+bool Relay::Lossless() const {
+  return true;
+}
+
+Log * Relay::SetLog(Log *p) {
+  Log *old = log_;
+  if (p)
+    log_ = p;
+  return old;
+}
+
+ssize_t Relay::Read(char *buf, size_t n) {
+  Dispatch();
+
+  size_t total = 0;
+  while (total < n && !ready_.empty()) {
+    Client *c = ready_.front();
+    size_t k = min(n - total, c->body.size() - c->body_offset);
+    memcpy(buf + total, &c->body[c->body_offset], k);
+    c->body_offset += k;
+    total += k;
+    read_bytes_ += k;
+
+    if (c->body_offset == c->body.size()) {
+      c->ack_offset = read_bytes_;
+      ready_.pop_front();
+      waiting_.push_back(c);
+    }
+  }
+
+  if (total == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return total;
+}
+
+void Relay::Acknowledge(uint64_t offset, bool ok) {
+  while (!waiting_.empty() && waiting_.front()->ack_offset <= offset) {
+    Client *c = waiting_.front();
+    waiting_.pop_front();
+    if (c->closed)
+      delete c;
+    else
+      Reply(c, ok ? 200 : 503);
+  }
+}
+
+#ifdef __linux__
+
+bool Relay::Listen(const char *address) {
+  char host[64] = "";
+  char port[6] = "";
+  if (sscanf(address, "%63[^:]:%5[0-9]", host, port) != 2) {
+    host[0] = 0;
+    snprintf(port, sizeof(port), "%s", address);
+  }
+
+  int rv;
+  struct addrinfo hints, *servinfo, *p;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  if ((rv = getaddrinfo(host[0] ? host : NULL, port, &hints, &servinfo))) {
+    warnx("%s: getaddrinfo() error: %s", __func__, gai_strerror(rv));
+    return false;
+  }
+
+  for (p = servinfo; p != NULL; p = p->ai_next) {
+    int s = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (s < 0)
+      continue;
+
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(s, p->ai_addr, p->ai_addrlen) == 0 && listen(s, SOMAXCONN) == 0) {
+      listen_fd_ = s;
+      break;
+    }
+    close(s);
+  }
+  freeaddrinfo(servinfo);
+
+  if (listen_fd_ < 0) {
+    warn("%s: unable to listen on %s", __func__, address);
+    return false;
+  }
+
+  int on = 1;
+  ioctl(listen_fd_, FIONBIO, &on);
+
+  if ((epoll_fd_ = epoll_create(64)) < 0) {
+    warn("%s: epoll_create() error", __func__);
+    return false;
+  }
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;  // the listening socket
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev) < 0) {
+    warn("%s: epoll_ctl() error", __func__);
+    return false;
+  }
+  return true;
+}
+
+void Relay::Dispatch() {
+  struct epoll_event events[64];
+  int n = epoll_wait(epoll_fd_, events, 64, 0);
+  if (n < 0 && errno != EINTR)
+    log_->Warn("%s: epoll_wait() error", __func__);
+
+  for (int i = 0; i < n; ++i) {
+    Client *c = static_cast<Client *>(events[i].data.ptr);
+    if (!c) {
+      Accept();
+      continue;
+    }
+
+    if ((events[i].events & EPOLLOUT) && !Send(c))
+      continue;  // closed
+    if ((events[i].events & EPOLLIN) && !Receive(c))
+      continue;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      Close(c);
+  }
+}
+
+void Relay::Accept() {
+  int fd;
+  while ((fd = accept(listen_fd_, NULL, NULL)) >= 0) {
+    int on = 1;
+    ioctl(fd, FIONBIO, &on);
+
+    Client *c = new Client;
+    c->fd = fd;
+    c->state = CLIENT_HEAD;
+    c->head_length = 0;
+    c->content_length = 0;
+    c->body_offset = 0;
+    c->zipped = false;
+    c->persistent = true;
+    c->ack_offset = 0;
+    c->reply_length = 0;
+    c->reply_offset = 0;
+    c->closed = false;
+
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      log_->Warn("%s: epoll_ctl() error", __func__);
+      close(fd);
+      delete c;
+      continue;
+    }
+
+    ++clients_;
+    if (verbose_)
+      log_->Info("* Relay: accepted, %zu clients\n", clients_);
+  }
+
+  if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    log_->Warn("%s: accept() error", __func__);
+}
+
+void Relay::Watch(Client *c, int events) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.ptr = c;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+    log_->Warn("%s: epoll_ctl() error", __func__);
+}
+
+void Relay::Close(Client *c) {
+  epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  c->fd = -1;
+  c->closed = true;
+  --clients_;
+  if (verbose_)
+    log_->Info("* Relay: closed, %zu clients\n", clients_);
+
+  // still referred by the queues until acknowledged
+  if (c->state != CLIENT_WAIT)
+    delete c;
+}
+
+#else  // no epoll
+
+bool Relay::Listen(const char *address) {
+  warnx("%s: relay is not supported on this platform", __func__);
+  return false;
+}
+
+void Relay::Dispatch() {
+  // empty
+}
+
+void Relay::Watch(Client *c, int events) {
+  // empty
+}
+
+void Relay::Close(Client *c) {
+  close(c->fd);
+  c->fd = -1;
+  c->closed = true;
+  if (c->state != CLIENT_WAIT)
+    delete c;
+}
+
+#endif  // __linux__
+
+bool Relay::Receive(Client *c) {
+  ssize_t n;
+  if (c->state == CLIENT_HEAD) {
+    n = read(c->fd, c->head + c->head_length,
+             sizeof(c->head) - 1 - c->head_length);
+    if (n <= 0) {
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        Close(c);
+        return false;
+      }
+      return true;
+    }
+    c->head_length += n;
+    c->head[c->head_length] = 0;
+
+    char *end = strstr(c->head, "\r\n\r\n");
+    if (!end) {
+      if (c->head_length == sizeof(c->head) - 1)
+        return Reply(c, 431);
+      return true;
+    }
+    int status = ParseHead(c);
+    if (status != 0)
+      return Reply(c, status);
+
+    // what follows the head is the beginning of the body
+    size_t rest = c->head + c->head_length - (end + 4);
+    rest = min(rest, c->content_length);
+    if (rest > 0)
+      memcpy(&c->body[0], end + 4, rest);
+    c->body_offset = rest;
+    c->state = CLIENT_BODY;
+  } else if (c->state == CLIENT_BODY) {
+    n = read(c->fd, &c->body[c->body_offset],
+             c->content_length - c->body_offset);
+    if (n <= 0) {
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        Close(c);
+        return false;
+      }
+      return true;
+    }
+    c->body_offset += n;
+  } else {
+    return true;
+  }
+
+  if (c->body_offset == c->content_length)
+    return Complete(c);
+  return true;
+}
+
+int Relay::ParseHead(Client *c) {
+  const char *p;
+
+  if (strncmp(c->head, "POST ", 5) != 0)
+    return 405;
+
+  if ((p = strcasestr(c->head, "Content-Length:")) == NULL)
+    return 411;
+  c->content_length = strtoul(p + 15, NULL, 10);
+  if (c->content_length > (size_t)max_body_)
+    return 413;
+
+  c->zipped = false;
+  if ((p = strcasestr(c->head, "LETV-ZIP:")) != NULL)
+    c->zipped = atoi(p + 9) == 1;
+
+  c->persistent = true;
+  if ((p = strcasestr(c->head, "Connection:")) != NULL) {
+    char token[8];
+    if (sscanf(p + 11, " %7[^\r]", token) == 1 &&
+        strcasecmp(token, "close") == 0)
+      c->persistent = false;
+  }
+
+  c->body.resize(c->content_length);
+  return 0;
+}
+
+bool Relay::Complete(Client *c) {
+  if (c->zipped) {
+    vector<char> plain;
+    if (!ZipDecompress(c->body, &plain)) {
+      log_->Warnx("%s: corrupted ZIP body", __func__);
+      return Reply(c, 400);
+    }
+    c->body.swap(plain);
+  }
+
+  // keep the records of different senders apart
+  if (!c->body.empty() && c->body[c->body.size() - 1] != '\n')
+    c->body.push_back('\n');
+
+  if (c->body.empty())
+    return Reply(c, 200);
+
+  c->body_offset = 0;
+  c->state = CLIENT_WAIT;
+  Watch(c, 0);  // no pipelining, the sender waits for the answer anyway
+  ready_.push_back(c);
+  return true;
+}
+
+bool Relay::Reply(Client *c, int status) {
+  const char *reason;
+  switch (status) {
+    case 200: reason = "OK"; break;
+    case 400: reason = "Bad Request"; break;
+    case 405: reason = "Method Not Allowed"; break;
+    case 411: reason = "Length Required"; break;
+    case 413: reason = "Payload Too Large"; break;
+    case 431: reason = "Request Header Fields Too Large"; break;
+    default: reason = "Service Unavailable"; break;
+  }
+
+  // an error leaves the stream in an unknown state, close it after
+  if (status != 200 && status != 503)
+    c->persistent = false;
+
+  c->reply_length = snprintf(c->reply, sizeof(c->reply),
+                             "HTTP/1.1 %d %s\r\n"
+                             "Content-Length: 0\r\n"
+                             "%s\r\n",
+                             status, reason,
+                             c->persistent ? "" : "Connection: close\r\n");
+  c->reply_offset = 0;
+  c->state = CLIENT_REPLY;
+  return Send(c);
+}
+
+bool Relay::Send(Client *c) {
+  if (c->state != CLIENT_REPLY)
+    return true;
+
+  ssize_t n = write(c->fd, c->reply + c->reply_offset,
+                    c->reply_length - c->reply_offset);
+  if (n < 0 && errno != EAGAIN && errno != EINTR) {
+    Close(c);
+    return false;
+  }
+
+  if (n > 0)
+    c->reply_offset += n;
+  if (c->reply_offset < c->reply_length) {
+    Watch(c, EPOLLOUT);
+    return true;
+  }
+
+  if (!c->persistent) {
+    Close(c);
+    return false;
+  }
+
+  // ready for the next request
+  c->state = CLIENT_HEAD;
+  c->head_length = 0;
+  c->body.clear();
+  c->body_offset = 0;
+  Watch(c, EPOLLIN);
+  return true;
+}
+
+}  // namespace v
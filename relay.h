@@ -0,0 +1,90 @@
+// relay.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef RELAY_H_
+#define RELAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <deque>
+#include <vector>
+
+#include "pipe.h"
+
+namespace v {
+
+using std::deque;
+using std::vector;
+
+// Relay accepts the POSTs of other pipes and gives their bodies to a
+// HttpPipe as input, so many pipes share a few large upstream requests.
+// Each POST is answered only after its body is delivered upstream, with 200,
+// or given up, with 503, so the sender keeps it until then.
+class Relay : public Source {
+ public:
+  Relay();
+  ~Relay();
+
+  bool Listen(const char *address);  // [HOST:]PORT
+
+  // Setting methods, as the ones of HttpPipe
+  int SetMaxBody(int n);
+  int SetVerbose(int n);
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+  bool Ready() const;
+  bool Lossless() const;
+  void Acknowledge(uint64_t offset, bool ok);
+  Log * SetLog(Log *p);
+
+ private:
+  enum ClientState { CLIENT_HEAD, CLIENT_BODY, CLIENT_WAIT, CLIENT_REPLY };
+
+  struct Client {
+    int fd;
+    ClientState state;
+    char head[MAX_QUERY];
+    size_t head_length;
+    vector<char> body;
+    size_t content_length;
+    size_t body_offset;  // received, then given to the pipe
+    bool zipped;
+    bool persistent;
+    uint64_t ack_offset;
+    char reply[128];
+    size_t reply_length;
+    size_t reply_offset;
+    bool closed;
+  };
+
+  void Dispatch();
+  void Accept();
+  // the ones taking a client return false once it is closed
+  bool Receive(Client *c);
+  int ParseHead(Client *c);  // 0, or the status to reply with
+  bool Complete(Client *c);
+  bool Reply(Client *c, int status);
+  bool Send(Client *c);
+  void Watch(Client *c, int events);
+  void Close(Client *c);
+
+  int listen_fd_;
+  int epoll_fd_;
+  int max_body_;
+#ifdef NO_VERBOSE
+  static const int verbose_ = 0;
+#else
+  int verbose_;
+#endif
+  Log *log_;
+  uint64_t read_bytes_;
+  deque<Client *> ready_;    // received, to be given to the pipe
+  deque<Client *> waiting_;  // given, to be acknowledged
+  size_t clients_;
+};
+
+}  // namespace v
+
+#endif  // RELAY_H_
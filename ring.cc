@@ -0,0 +1,207 @@
+// ring.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "ring.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+#include <algorithm>
+
+#define ALIGN8(n)  (((n) + 7) & ~(size_t)7)
+
+using std::min;
+
+namespace v {
+
+Ring::Ring()
+    : buffer_(NULL),
+      size_(0),
+      head_(0),
+      head_pad_(),
+      tail_(0),
+      tail_pad_(),
+      partial_(0),
+      waiting_(0),
+      refused_(0) {
+  event_fd_[0] = event_fd_[1] = -1;
+}
+
+Ring::~Ring() {
+  free(buffer_);
+  if (event_fd_[1] >= 0 && event_fd_[1] != event_fd_[0])
+    close(event_fd_[1]);
+  if (event_fd_[0] >= 0)
+    close(event_fd_[0]);
+}
+
+bool Ring::Init(size_t size) {
+  size_ = 64;
+  while (size_ < size)
+    size_ *= 2;
+
+  buffer_ = static_cast<char *>(calloc(size_, 1));
+  if (!buffer_) {
+    warn("%s: calloc(%zu) error", __func__, size_);
+    return false;
+  }
+
+#ifdef __linux__
+  event_fd_[0] = event_fd_[1] = eventfd(0, EFD_NONBLOCK);
+  if (event_fd_[0] < 0) {
+    warn("%s: eventfd() error", __func__);
+    return false;
+  }
+#else
+  if (pipe(event_fd_) < 0) {
+    warn("%s: pipe() error", __func__);
+    return false;
+  }
+  fcntl(event_fd_[0], F_SETFL, fcntl(event_fd_[0], F_GETFL) | O_NONBLOCK);
+  fcntl(event_fd_[1], F_SETFL, fcntl(event_fd_[1], F_GETFL) | O_NONBLOCK);
+#endif
+  return true;
+}
+
+bool Ring::Write(const void *p, size_t n) {
+  void *data = Reserve(n);
+  if (!data)
+    return false;
+
+  memcpy(data, p, n);
+  Commit(data);
+  return true;
+}
+
+void * Ring::Reserve(size_t n) {
+  size_t total = ALIGN8(sizeof(Record) + n);
+  uint64_t head;
+  size_t padding;
+
+  do {
+    head = head_;
+    uint64_t tail = tail_;
+    // a record never wraps, the end of the ring is padded instead
+    size_t offset = head & (size_ - 1);
+    padding = size_ - offset < total ? size_ - offset : 0;
+    if (total > size_ || head + padding + total - tail > size_) {
+      __sync_fetch_and_add(&refused_, 1);
+      return NULL;
+    }
+  } while (!__sync_bool_compare_and_swap(&head_, head,
+                                         head + padding + total));
+
+  if (padding) {
+    Record *pad = At(head);
+    pad->length = padding;
+    __sync_synchronize();
+    pad->state = RECORD_PADDING;
+  }
+
+  Record *record = At(head + padding);
+  record->length = n;
+  return record + 1;
+}
+
+void Ring::Commit(void *p) {
+  Record *record = static_cast<Record *>(p) - 1;
+  __sync_synchronize();  // the data before the state
+  record->state = RECORD_COMMITTED;
+  __sync_synchronize();  // the state before the check of the pipe
+
+  if (waiting_ && __sync_bool_compare_and_swap(&waiting_, 1, 0))
+    Wake();
+}
+
+size_t Ring::Refused() const {
+  return refused_;
+}
+
+int Ring::Descriptor() const {
+  return event_fd_[0];
+}
+
+ssize_t Ring::Read(char *buf, size_t n) {
+  size_t copied = 0;
+
+  for (;;) {
+    while (copied < n) {
+      uint64_t tail = tail_;
+      Record *record = At(tail);
+      uint32_t state = record->state;
+      if (state == RECORD_FREE)
+        break;
+      __sync_synchronize();  // the state before the data
+
+      size_t total = state == RECORD_PADDING ? record->length :
+                     ALIGN8(sizeof(Record) + record->length);
+      if (state == RECORD_COMMITTED) {
+        size_t m = min<size_t>(record->length - partial_, n - copied);
+        memcpy(buf + copied, reinterpret_cast<char *>(record + 1) + partial_,
+               m);
+        copied += m;
+        partial_ += m;
+        if (partial_ < record->length)
+          break;
+        partial_ = 0;
+      }
+
+      memset(record, 0, total);
+      __sync_synchronize();  // zeroed before given back
+      tail_ = tail + total;
+    }
+
+    if (copied == n)
+      return copied;
+
+    // found empty, the next commit rings unless one came meanwhile
+    Drain();
+    waiting_ = 1;
+    __sync_synchronize();
+    if (!Ready())
+      break;
+    waiting_ = 0;
+  }
+
+  if (copied > 0)
+    return copied;
+
+  errno = EAGAIN;
+  return -1;
+}
+
+bool Ring::Ready() const {
+  return At(tail_)->state != RECORD_FREE;
+}
+
+bool Ring::Lossless() const {
+  return true;  // the producers are refused, rather than overwritten
+}
+
+Ring::Record * Ring::At(uint64_t offset) const {
+  return reinterpret_cast<Record *>(buffer_ + (offset & (size_ - 1)));
+}
+
+void Ring::Wake() {
+  uint64_t one = 1;
+#ifdef __linux__
+  ssize_t res = write(event_fd_[1], &one, sizeof(one));
+#else
+  ssize_t res = write(event_fd_[1], &one, 1);
+#endif
+  (void)res;  // EAGAIN, already awake
+}
+
+void Ring::Drain() {
+  uint64_t count;
+  while (read(event_fd_[0], &count, sizeof(count)) > 0)
+    continue;
+}
+
+}  // namespace v
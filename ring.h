@@ -0,0 +1,71 @@
+// ring.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef RING_H_
+#define RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "pipe.h"
+
+namespace v {
+
+// Ring takes records from any number of threads of the process and gives
+// them to a HttpPipe as input, without a system call on either side unless
+// the pipe sleeps.
+//
+// A producer claims room with a compare-and-swap on the head, writes the
+// record and commits it by setting the state of its header; the pipe, the
+// only consumer, copies the committed records in order, zeroes what it
+// took, so a stale byte never looks like a header, and moves the tail.
+// While the ring is empty the pipe polls an eventfd, which the first
+// commit after that rings.
+class Ring : public Source {
+ public:
+  Ring();
+  ~Ring();
+
+  bool Init(size_t size);  // rounded up to a power of 2
+
+  // false or NULL if there is no room for the record now, the records are
+  // given to the pipe as they are, lines should end with '\n'
+  bool Write(const void *p, size_t n);
+  void * Reserve(size_t n);
+  void Commit(void *p);
+
+  size_t Refused() const;  // records without room so far
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+  bool Ready() const;
+  bool Lossless() const;
+
+ private:
+  enum { RECORD_FREE = 0, RECORD_COMMITTED = 1, RECORD_PADDING = 2 };
+
+  struct Record {
+    volatile uint32_t length;  // of the data following, or the padding
+    volatile uint32_t state;
+  };
+
+  Record * At(uint64_t offset) const;
+  void Wake();
+  void Drain();
+
+  char *buffer_;
+  size_t size_;
+  volatile uint64_t head_;  // claimed by the producers up to
+  char head_pad_[64];       // apart from the tail, in another cache line
+  volatile uint64_t tail_;  // taken by the pipe up to
+  char tail_pad_[64];
+  size_t partial_;          // of the record at the tail, taken so far
+  volatile int waiting_;    // the pipe is about to sleep
+  volatile size_t refused_;
+  int event_fd_[2];         // read and write end, the same for an eventfd
+};
+
+}  // namespace v
+
+#endif  // RING_H_
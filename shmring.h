@@ -0,0 +1,186 @@
+/* shmring.h
+ * Copyright 2014 <Vegertar, vegertar@gmail.com>
+ *
+ * The producer side of a shared memory input of the pipe, in plain C, to be
+ * copied into a producer that cannot link against the pipe:
+ *
+ *   struct shm_ring_producer p;
+ *   if (shm_ring_attach(&p, "/run/pipe.sock") == 0) {
+ *     size_t room;
+ *     char *s = shm_ring_reserve(&p, &room);
+ *     ... format up to room bytes of whole lines at s ...
+ *     shm_ring_commit(&p, n);
+ *     ...
+ *     shm_ring_detach(&p);
+ *   }
+ *
+ * The pipe, started with --shm PATH or an input shm:PATH, creates the ring
+ * in a memfd and listens at the unix socket PATH; a producer connects and
+ * receives the memfd with SCM_RIGHTS, one producer at a time. The ring is
+ * single producer, single consumer:
+ *
+ *   offset 0     struct shm_ring, the header, in its own page
+ *   offset 4096  the data, size bytes, a power of 2, the bytes of the
+ *                records written as they would be to the standard input
+ *
+ * head and tail are byte counts since the ring was created, the data in
+ * [tail, head) is for the pipe, at offset & (size - 1); head is moved by
+ * the producer only, once the bytes are in, tail by the pipe only, once
+ * they are taken. Before the pipe sleeps it sets waiting, and a producer
+ * committing then clears it and writes a byte to the socket to wake it;
+ * the socket closing tells the pipe the producer is gone.
+ */
+
+#ifndef SHMRING_H_
+#define SHMRING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define SHM_RING_MAGIC        0x7673686d72696e01ULL
+#define SHM_RING_DATA_OFFSET  4096
+
+struct shm_ring {
+  volatile uint64_t magic;  /* set once initialized */
+  uint64_t size;
+  char pad0[48];
+  volatile uint64_t head;   /* in its own cache line, the producer's */
+  char pad1[56];
+  volatile uint64_t tail;   /* the pipe's */
+  volatile uint32_t waiting;
+  char pad2[52];
+};
+
+struct shm_ring_producer {
+  struct shm_ring *ring;
+  char *data;
+  int fd;                   /* the connection to the pipe */
+};
+
+/* 0 on success, -1 with errno on failure */
+static inline int shm_ring_attach(struct shm_ring_producer *p,
+                                  const char *path) {
+  struct sockaddr_un addr;
+  char byte;
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  int memfd = -1;
+  void *base;
+
+  memset(p, 0, sizeof(*p));
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+  p->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (p->fd < 0)
+    return -1;
+  if (connect(p->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    goto fail;
+
+  /* the pipe sends the memfd as soon as it takes this producer */
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(p->fd, &msg, 0) <= 0)
+    goto fail;
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+      memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+  if (memfd < 0)
+    goto fail;
+
+  base = mmap(NULL, SHM_RING_DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED,
+              memfd, 0);
+  if (base == MAP_FAILED)
+    goto fail;
+  p->ring = (struct shm_ring *)base;
+  if (p->ring->magic != SHM_RING_MAGIC) {
+    munmap(base, SHM_RING_DATA_OFFSET);
+    p->ring = NULL;
+    goto fail;
+  }
+
+  base = mmap(NULL, SHM_RING_DATA_OFFSET + p->ring->size,
+              PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  munmap(p->ring, SHM_RING_DATA_OFFSET);
+  p->ring = NULL;
+  if (base == MAP_FAILED)
+    goto fail;
+  p->ring = (struct shm_ring *)base;
+  p->data = (char *)base + SHM_RING_DATA_OFFSET;
+  close(memfd);
+  return 0;
+
+ fail:
+  if (memfd >= 0)
+    close(memfd);
+  close(p->fd);
+  p->fd = -1;
+  return -1;
+}
+
+static inline void shm_ring_detach(struct shm_ring_producer *p) {
+  if (p->ring)
+    munmap(p->ring, SHM_RING_DATA_OFFSET + p->ring->size);
+  if (p->fd >= 0)
+    close(p->fd);
+  memset(p, 0, sizeof(*p));
+  p->fd = -1;
+}
+
+/* the room at the head, contiguous up to the end of the data, 0 if full */
+static inline char * shm_ring_reserve(struct shm_ring_producer *p,
+                                      size_t *room) {
+  uint64_t size = p->ring->size;
+  uint64_t head = p->ring->head;
+  uint64_t offset = head & (size - 1);
+  uint64_t free_bytes = size - (head - p->ring->tail);
+  *room = free_bytes < size - offset ? free_bytes : size - offset;
+  return p->data + offset;
+}
+
+/* gives the n bytes written at the reserved room to the pipe */
+static inline void shm_ring_commit(struct shm_ring_producer *p, size_t n) {
+  __sync_synchronize();  /* the data before the head */
+  p->ring->head += n;
+  __sync_synchronize();  /* the head before the check of the pipe */
+
+  if (p->ring->waiting &&
+      __sync_bool_compare_and_swap(&p->ring->waiting, 1, 0))
+    send(p->fd, "", 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+/* as write(2) of a non-blocking descriptor, the bytes taken, maybe fewer
+ * than n, 0 if the ring is full */
+static inline size_t shm_ring_write(struct shm_ring_producer *p,
+                                    const void *buf, size_t n) {
+  size_t done = 0;
+  while (done < n) {
+    size_t room;
+    char *s = shm_ring_reserve(p, &room);
+    if (room == 0)
+      break;
+    if (room > n - done)
+      room = n - done;
+    memcpy(s, (const char *)buf + done, room);
+    shm_ring_commit(p, room);
+    done += room;
+  }
+  return done;
+}
+
+#endif  /* SHMRING_H_ */
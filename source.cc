@@ -0,0 +1,753 @@
+// source.cc
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#include "source.h"
+
+#include <dirent.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <algorithm>
+
+#include "shmring.h"
+
+#define SHM_RING_SIZE  (4 << 20)  // 4M
+#define MAX_DATAGRAMS  64         // taken by one recvmmsg(2)
+#define MAX_DATAGRAM   65536      // room for each, a UDP one is smaller
+
+using std::max;
+using std::min;
+
+namespace {
+
+// a non-blocking stream socket listening at path, -1 on failure
+int ListenAt(const char *path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    warnx("%s: path too long: %s", __func__, path);
+    return -1;
+  }
+  snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (s < 0) {
+    warn("%s: socket() error", __func__);
+    return -1;
+  }
+
+  unlink(path);  // left behind by a previous run
+  if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(s, 64) < 0) {
+    warn("%s: unable to listen at %s", __func__, path);
+    close(s);
+    return -1;
+  }
+
+  fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+  return s;
+}
+
+// an anonymous file to share by descriptor
+int CreateMemory(size_t size) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+  int fd = memfd_create("pipe-shm", MFD_CLOEXEC);
+#else
+  char name[] = "/tmp/pipe-shm-XXXXXX";
+  int fd = mkstemp(name);
+  if (fd >= 0)
+    unlink(name);
+#endif
+  if (fd < 0) {
+    warn("%s: unable to create shared memory", __func__);
+    return -1;
+  }
+
+  if (ftruncate(fd, size) < 0) {
+    warn("%s: ftruncate(%zu) error", __func__, size);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+}  // anonymous namespace
+
+namespace v {
+
+UnixSource::UnixSource()
+    : listen_fd_(-1),
+      client_fd_(-1) {
+  // empty
+}
+
+UnixSource::~UnixSource() {
+  if (client_fd_ >= 0)
+    close(client_fd_);
+  if (listen_fd_ >= 0)
+    close(listen_fd_);
+}
+
+bool UnixSource::Listen(const char *path) {
+  listen_fd_ = ListenAt(path);
+  return listen_fd_ >= 0;
+}
+
+int UnixSource::Descriptor() const {
+  return client_fd_ >= 0 ? client_fd_ : listen_fd_;
+}
+
+ssize_t UnixSource::Read(char *buf, size_t n) {
+  if (client_fd_ < 0) {
+    client_fd_ = accept(listen_fd_, NULL, NULL);
+    if (client_fd_ >= 0)
+      fcntl(client_fd_, F_SETFL, fcntl(client_fd_, F_GETFL) | O_NONBLOCK);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  ssize_t res = read(client_fd_, buf, n);
+  if (res == 0 || (res < 0 && errno != EINTR && errno != EAGAIN)) {
+    // the producer hung up, the socket lives on for the next one
+    close(client_fd_);
+    client_fd_ = -1;
+    errno = EAGAIN;
+    return -1;
+  }
+  return res;
+}
+
+ShmSource::ShmSource()
+    : memfd_(-1),
+      ring_(NULL),
+      data_(NULL),
+      listen_fd_(-1),
+      client_fd_(-1),
+      log_(NULL) {
+  // empty
+}
+
+ShmSource::~ShmSource() {
+  if (client_fd_ >= 0)
+    close(client_fd_);
+  if (listen_fd_ >= 0)
+    close(listen_fd_);
+  if (ring_)
+    munmap(ring_, SHM_RING_DATA_OFFSET + ring_->size);
+  if (memfd_ >= 0)
+    close(memfd_);
+}
+
+bool ShmSource::Listen(const char *path, size_t size) {
+  memfd_ = CreateMemory(SHM_RING_DATA_OFFSET + size);
+  if (memfd_ < 0)
+    return false;
+
+  void *p = mmap(NULL, SHM_RING_DATA_OFFSET + size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, memfd_, 0);
+  if (p == MAP_FAILED) {
+    warn("%s: mmap() error", __func__);
+    return false;
+  }
+  ring_ = static_cast<struct shm_ring *>(p);
+  data_ = static_cast<char *>(p) + SHM_RING_DATA_OFFSET;
+  ring_->size = size;
+  ring_->head = ring_->tail = 0;
+  ring_->waiting = 0;
+  __sync_synchronize();
+  ring_->magic = SHM_RING_MAGIC;
+
+  listen_fd_ = ListenAt(path);
+  return listen_fd_ >= 0;
+}
+
+int ShmSource::Descriptor() const {
+  return client_fd_ >= 0 ? client_fd_ : listen_fd_;
+}
+
+ssize_t ShmSource::Read(char *buf, size_t n) {
+  if (client_fd_ < 0)
+    Accept();
+
+  // what the last producer left is taken even if none is attached
+  size_t copied = 0;
+  for (;;) {
+    uint64_t head = ring_->head;
+    __sync_synchronize();  // the head before the data
+    uint64_t tail = ring_->tail;
+    size_t m = min<uint64_t>(head - tail, n - copied);
+    size_t offset = tail & (ring_->size - 1);
+    size_t first = min<size_t>(m, ring_->size - offset);
+    memcpy(buf + copied, data_ + offset, first);
+    memcpy(buf + copied + first, data_, m - first);
+    __sync_synchronize();  // taken before given back
+    ring_->tail = tail + m;
+    copied += m;
+
+    if (copied == n || client_fd_ < 0)
+      break;
+
+    // found empty, the next commit rings unless one came meanwhile
+    if (!Drain()) {
+      close(client_fd_);
+      client_fd_ = -1;
+      continue;  // for the bytes committed right before
+    }
+    ring_->waiting = 1;
+    __sync_synchronize();
+    if (ring_->head == ring_->tail)
+      break;
+    ring_->waiting = 0;
+  }
+
+  if (copied > 0)
+    return copied;
+
+  errno = EAGAIN;
+  return -1;
+}
+
+bool ShmSource::Ready() const {
+  return ring_->head != ring_->tail;
+}
+
+bool ShmSource::Lossless() const {
+  return true;  // the producer finds the ring full, rather than overwritten
+}
+
+Log * ShmSource::SetLog(Log *p) {
+  Log *old = log_;
+  if (p)
+    log_ = p;
+  return old;
+}
+
+void ShmSource::Accept() {
+  client_fd_ = accept(listen_fd_, NULL, NULL);
+  if (client_fd_ < 0)
+    return;
+
+  // the memory goes with the first byte
+  char byte = 0;
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = { &byte, 1 };
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &memfd_, sizeof(int));
+
+  if (sendmsg(client_fd_, &msg, MSG_NOSIGNAL) < 0) {
+    log_->Warn("%s: sendmsg() error", __func__);
+    close(client_fd_);
+    client_fd_ = -1;
+    return;
+  }
+  fcntl(client_fd_, F_SETFL, fcntl(client_fd_, F_GETFL) | O_NONBLOCK);
+}
+
+bool ShmSource::Drain() {
+  char bytes[64];
+  for (;;) {
+    ssize_t res = recv(client_fd_, bytes, sizeof(bytes), MSG_DONTWAIT);
+    if (res == 0)
+      return false;
+    if (res < 0)
+      return errno == EINTR || errno == EAGAIN;
+  }
+}
+
+TailSource::TailSource()
+    : fd_(-1),
+      notify_fd_(-1),
+      log_(NULL),
+      dev_(0),
+      ino_(0),
+      offset_(0),
+      size_(0),
+      read_(0),
+      segments_(),
+      poll_time_(0) {
+  path_[0] = state_[0] = 0;
+}
+
+TailSource::~TailSource() {
+  if (fd_ >= 0)
+    close(fd_);
+  if (notify_fd_ >= 0)
+    close(notify_fd_);
+}
+
+bool TailSource::Open(const char *path, const char *state) {
+  snprintf(path_, sizeof(path_), "%s", path);
+  if (state)
+    snprintf(state_, sizeof(state_), "%s", state);
+
+#ifdef __linux__
+  // the directory is watched, so the file may come and go
+  char dir[1024];
+  snprintf(dir, sizeof(dir), "%s", path);
+  notify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify_fd_ < 0 ||
+      inotify_add_watch(notify_fd_, dirname(dir), IN_MODIFY | IN_CREATE |
+                        IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+    warn("%s: unable to watch %s", __func__, dir);
+    return false;
+  }
+#endif
+
+  if (Resume())
+    return true;
+
+  // from the end, as the ones before are not ours
+  if (Reopen())
+    offset_ = size_;
+  else if (errno != ENOENT)
+    warn("%s: unable to open %s", __func__, path_);
+  return true;
+}
+
+int TailSource::Descriptor() const {
+  return notify_fd_;
+}
+
+ssize_t TailSource::Read(char *buf, size_t n) {
+  Drain();
+  poll_time_ = time(NULL);
+
+  for (;;) {
+    if (fd_ < 0 && !Reopen()) {
+      if (errno != ENOENT)
+        log_->Warn("%s: unable to open %s", __func__, path_);
+      break;  // not created yet, or not ours to read
+    }
+
+    ssize_t res = pread(fd_, buf, n, offset_);
+    if (res > 0) {
+      offset_ += res;
+      size_ = max(size_, offset_);
+      read_ += res;
+      return res;
+    }
+    if (res < 0) {
+      if (errno == EINTR)
+        continue;
+      log_->Warn("%s: pread(%s) error", __func__, path_);
+      break;
+    }
+
+    // at the end, truncated, or rotated and done with the old one
+    struct stat st;
+    if (fstat(fd_, &st) == 0) {
+      size_ = st.st_size;
+      if (st.st_size > offset_)
+        continue;
+      if (st.st_size < offset_) {
+        log_->Warnx("%s: %s truncated", __func__, path_);
+        Follow(fd_, st, 0);
+        continue;
+      }
+    }
+    if (stat(path_, &st) == 0 && (st.st_dev != dev_ || st.st_ino != ino_)) {
+      close(fd_);
+      fd_ = -1;
+      continue;
+    }
+    break;
+  }
+
+  errno = EAGAIN;
+  return -1;
+}
+
+bool TailSource::Ready() const {
+  if (fd_ >= 0 && offset_ < size_)
+    return true;  // behind the writer
+  return notify_fd_ < 0 && time(NULL) != poll_time_;
+}
+
+bool TailSource::Lossless() const {
+  return true;  // the file keeps what the pipe has no room for
+}
+
+void TailSource::Acknowledge(uint64_t offset, bool ok) {
+  while (segments_.size() > 1 && segments_[1].start <= offset)
+    segments_.pop_front();
+  if (segments_.empty() || !*state_)
+    return;
+
+  // replaced at once, never half written
+  const Segment &s = segments_.front();
+  char tmp[1040];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", state_);
+  FILE *fp = fopen(tmp, "w");
+  if (!fp) {
+    log_->Warn("%s: unable to save %s", __func__, tmp);
+    return;
+  }
+  fprintf(fp, "%llu %llu %lld\n", (unsigned long long)s.dev,
+          (unsigned long long)s.ino,
+          (long long)(s.offset + (offset - s.start)));
+  if (fclose(fp) != 0 || rename(tmp, state_) != 0)
+    log_->Warn("%s: unable to save %s", __func__, state_);
+}
+
+Log * TailSource::SetLog(Log *p) {
+  Log *old = log_;
+  if (p)
+    log_ = p;
+  return old;
+}
+
+bool TailSource::Reopen() {
+  int fd = open(path_, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  fstat(fd, &st);
+  Follow(fd, st, 0);
+  return true;
+}
+
+void TailSource::Follow(int fd, const struct stat &st, off_t offset) {
+  if (fd_ >= 0 && fd_ != fd)
+    close(fd_);
+  fd_ = fd;
+  dev_ = st.st_dev;
+  ino_ = st.st_ino;
+  offset_ = offset;
+  size_ = st.st_size;
+
+  Segment s = { read_, dev_, ino_, offset_ };
+  if (!segments_.empty() && segments_.back().start == read_)
+    segments_.back() = s;
+  else
+    segments_.push_back(s);
+}
+
+bool TailSource::Resume() {
+  FILE *fp = *state_ ? fopen(state_, "r") : NULL;
+  if (!fp)
+    return false;
+
+  unsigned long long dev, ino;
+  long long offset;
+  int fields = fscanf(fp, "%llu %llu %lld", &dev, &ino, &offset);
+  fclose(fp);
+  if (fields != 3) {
+    warnx("%s: %s is broken, ignored", __func__, state_);
+    return false;
+  }
+
+  // the file of the state, where it is now
+  struct stat st;
+  if (stat(path_, &st) == 0 && st.st_dev == (dev_t)dev &&
+      st.st_ino == (ino_t)ino) {
+    Reopen();
+  } else {
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", path_);
+    dirname(dir);
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d && fd_ < 0 && (e = readdir(d))) {
+      char rotated[2048];
+      snprintf(rotated, sizeof(rotated), "%s/%s", dir, e->d_name);
+      if (stat(rotated, &st) == 0 && st.st_dev == (dev_t)dev &&
+          st.st_ino == (ino_t)ino) {
+        int fd = open(rotated, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0)
+          Follow(fd, st, 0);
+      }
+    }
+    if (d)
+      closedir(d);
+    if (fd_ < 0) {
+      warnx("%s: the file of %s is gone, resumed at the start of %s",
+            __func__, state_, path_);
+      Reopen();
+      return true;
+    }
+  }
+
+  if (fd_ >= 0 && offset <= size_) {
+    offset_ = offset;
+    segments_.back().offset = offset_;
+  }
+  return true;
+}
+
+void TailSource::Drain() {
+  char events[4096];
+  while (notify_fd_ >= 0 && read(notify_fd_, events, sizeof(events)) > 0)
+    continue;  // only a wakeup, the file is looked at anyway
+}
+
+DatagramSource::DatagramSource()
+    : fd_(-1),
+      dropped_(0),
+      truncated_(0) {
+  // empty
+}
+
+DatagramSource::~DatagramSource() {
+  if (fd_ >= 0)
+    close(fd_);
+}
+
+bool DatagramSource::Bind(const char *address, int rcvbuf) {
+  if (strchr(address, '/')) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(address) >= sizeof(addr.sun_path)) {
+      warnx("%s: path too long: %s", __func__, address);
+      return false;
+    }
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", address);
+
+    fd_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+    unlink(address);  // left behind by a previous run
+    if (fd_ < 0 || bind(fd_, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      warn("%s: unable to bind %s", __func__, address);
+      return false;
+    }
+  } else {
+    // an IPv6 host is in brackets, e.g. [::1]:514
+    char host[256];
+    const char *port;
+    if (address[0] == '[') {
+      const char *end = strchr(address, ']');
+      if (!end || end[1] != ':') {
+        warnx("%s: invalid address: %s", __func__, address);
+        return false;
+      }
+      snprintf(host, sizeof(host), "%.*s", (int)(end - address - 1),
+               address + 1);
+      port = end + 2;
+    } else {
+      port = strrchr(address, ':');
+      snprintf(host, sizeof(host), "%.*s", port ? (int)(port - address) : 0,
+               address);
+      port = port ? port + 1 : address;
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE;
+    int e = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+    if (e != 0) {
+      warnx("%s: getaddrinfo(%s) error: %s", __func__, address,
+            gai_strerror(e));
+      return false;
+    }
+    fd_ = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd_ >= 0) {
+      int on = 1;
+      setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    }
+    bool bound = fd_ >= 0 && bind(fd_, res->ai_addr, res->ai_addrlen) == 0;
+    freeaddrinfo(res);
+    if (!bound) {
+      warn("%s: unable to bind %s", __func__, address);
+      return false;
+    }
+  }
+
+  if (rcvbuf > 0) {
+#ifdef SO_RCVBUFFORCE
+    if (setsockopt(fd_, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+                   sizeof(rcvbuf)) < 0)
+#endif
+      setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    int n = 0;
+    socklen_t len = sizeof(n);
+    getsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &n, &len);
+    if (n < rcvbuf)  // doubled by Linux for its bookkeeping
+      warnx("%s: receive buffer of %s is %d bytes, not %d", __func__, address,
+            n, rcvbuf);
+  }
+
+#ifdef SO_RXQ_OVFL
+  int on = 1;
+  setsockopt(fd_, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+#endif
+  fcntl(fd_, F_SETFL, fcntl(fd_, F_GETFL) | O_NONBLOCK);
+  return true;
+}
+
+int DatagramSource::Descriptor() const {
+  return fd_;
+}
+
+ssize_t DatagramSource::Read(char *buf, size_t n) {
+  if (n < 2) {
+    errno = EAGAIN;
+    return -1;
+  }
+
+  // short only if the whole buffer of the pipe is, see Room()
+  size_t slot = min<size_t>(n, MAX_DATAGRAM + 1);  // and the '\n'
+
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+  // each datagram in a slot of its own, moved down after
+  unsigned int vlen = min<size_t>(n / slot, MAX_DATAGRAMS);
+  struct mmsghdr msgs[MAX_DATAGRAMS];
+  struct iovec iovs[MAX_DATAGRAMS];
+  char controls[MAX_DATAGRAMS][CMSG_SPACE(sizeof(uint32_t))];
+  memset(msgs, 0, sizeof(msgs[0]) * vlen);
+  for (unsigned int i = 0; i < vlen; ++i) {
+    iovs[i].iov_base = buf + i * slot;
+    iovs[i].iov_len = slot - 1;  // room for the '\n'
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+    msgs[i].msg_hdr.msg_control = controls[i];
+    msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+  }
+
+  int got = recvmmsg(fd_, msgs, vlen, MSG_DONTWAIT, NULL);
+  if (got <= 0)
+    return -1;  // with errno of recvmmsg(2), EAGAIN if none
+
+  size_t length = 0;
+  for (int i = 0; i < got; ++i) {
+    struct msghdr *h = &msgs[i].msg_hdr;
+    size_t m = msgs[i].msg_len;
+    if (h->msg_flags & MSG_TRUNC)
+      ++truncated_;
+#ifdef SO_RXQ_OVFL
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(h); c; c = CMSG_NXTHDR(h, c))
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+        memcpy(&dropped_, CMSG_DATA(c), sizeof(dropped_));
+#endif
+    memmove(buf + length, buf + i * slot, m);
+    length += m;
+    if (m == 0 || buf[length - 1] != '\n')
+      buf[length++] = '\n';
+  }
+  return length;
+#else
+  size_t length = 0;
+  for (int i = 0; i < MAX_DATAGRAMS && n - length >= slot; ++i) {
+    struct iovec iov = { buf + length, slot - 1 };
+    struct msghdr h;
+    memset(&h, 0, sizeof(h));
+    h.msg_iov = &iov;
+    h.msg_iovlen = 1;
+    ssize_t m = recvmsg(fd_, &h, MSG_DONTWAIT);
+    if (m < 0)
+      break;
+    if (h.msg_flags & MSG_TRUNC)
+      ++truncated_;
+    length += m;
+    if (m == 0 || buf[length - 1] != '\n')
+      buf[length++] = '\n';
+  }
+  if (length == 0) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return length;
+#endif
+}
+
+size_t DatagramSource::Lost() const {
+  return dropped_ + truncated_;
+}
+
+size_t DatagramSource::Room() const {
+  return MAX_DATAGRAM + 1;
+}
+
+Source * OpenSource(const char *spec) {
+  if (strcmp(spec, "stdin") == 0)
+    return new FdSource(STDIN_FILENO);
+
+  int fd = -1;
+  if (strncmp(spec, "fifo:", 5) == 0) {
+    const char *path = spec + 5;
+    if (mkfifo(path, 0666) < 0 && errno != EEXIST) {
+      warn("%s: mkfifo(%s) error", __func__, path);
+      return NULL;
+    }
+    fd = open(path, O_RDWR | O_NONBLOCK);
+  } else if (strncmp(spec, "file:", 5) == 0) {
+    fd = open(spec + 5, O_RDONLY);
+  } else if (strncmp(spec, "unix:", 5) == 0) {
+    UnixSource *source = new UnixSource;
+    if (source->Listen(spec + 5))
+      return source;
+    delete source;
+    return NULL;
+  } else if (strncmp(spec, "tail:", 5) == 0) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s", spec + 5);
+    char *state = strchr(path, ',');
+    if (state)
+      *state++ = 0;
+    TailSource *source = new TailSource;
+    if (source->Open(path, state))
+      return source;
+    delete source;
+    return NULL;
+  } else if (strncmp(spec, "udp:", 4) == 0 ||
+             strncmp(spec, "unixgram:", 9) == 0) {
+    // a unix socket is told by its path
+    char address[1024];
+    const char *s = strchr(spec, ':') + 1;
+    bool relative = strncmp(spec, "unixgram:", 9) == 0 && !strchr(s, '/');
+    snprintf(address, sizeof(address), "%s%s", relative ? "./" : "", s);
+    char *rcvbuf = strchr(address, ',');
+    if (rcvbuf)
+      *rcvbuf++ = 0;
+    DatagramSource *source = new DatagramSource;
+    if (source->Bind(address, rcvbuf ? atoi(rcvbuf) : 0))
+      return source;
+    delete source;
+    return NULL;
+  } else if (strncmp(spec, "shm:", 4) == 0) {
+    ShmSource *source = new ShmSource;
+    if (source->Listen(spec + 4, SHM_RING_SIZE))
+      return source;
+    delete source;
+    return NULL;
+  } else {
+    warnx("%s: unknown input: %s", __func__, spec);
+    return NULL;
+  }
+
+  if (fd < 0) {
+    warn("%s: unable to open %s", __func__, spec);
+    return NULL;
+  }
+  return new FdSource(fd);
+}
+
+}  // namespace v
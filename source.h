@@ -0,0 +1,154 @@
+// source.h
+// Copyright 2014 <Vegertar, vegertar@gmail.com>
+
+#ifndef SOURCE_H_
+#define SOURCE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "pipe.h"
+
+struct shm_ring;
+
+namespace v {
+
+// A stream socket at a filesystem path, accepting its producers one at a
+// time, the others wait in the backlog until the current one hangs up
+class UnixSource : public Source {
+ public:
+  UnixSource();
+  ~UnixSource();
+
+  bool Listen(const char *path);
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+
+ private:
+  int listen_fd_;
+  int client_fd_;
+};
+
+// A ring in shared memory written in place by a producer process, see
+// shmring.h for the layout and the producer side; the producers attach at
+// a unix socket one at a time, as the ones of UnixSource, and a producer
+// leaving is no EOF, the ring lives on for the next one
+class ShmSource : public Source {
+ public:
+  ShmSource();
+  ~ShmSource();
+
+  bool Listen(const char *path, size_t size);  // size is a power of 2
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+  bool Ready() const;
+  bool Lossless() const;
+  Log * SetLog(Log *p);
+
+ private:
+  void Accept();
+  bool Drain();  // false once the producer hung up
+
+  int memfd_;
+  struct shm_ring *ring_;
+  char *data_;
+  int listen_fd_;
+  int client_fd_;
+  Log *log_;
+};
+
+// Follows a file as tail -F does, through renames, removals and
+// truncations, woken by inotify on its directory where available or once a
+// second otherwise; the bytes behind the writer are read in chunks as large
+// as the pipe takes. Given a state file, the offset acknowledged by the pipe
+// is kept there and a restart resumes right after it, in the rotated file
+// if it was rotated meanwhile; without one, it starts at the end
+class TailSource : public Source {
+ public:
+  TailSource();
+  ~TailSource();
+
+  bool Open(const char *path, const char *state);  // state may be NULL
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+  bool Ready() const;
+  bool Lossless() const;
+  void Acknowledge(uint64_t offset, bool ok);
+  Log * SetLog(Log *p);
+
+ private:
+  // the bytes read from start on are the ones of a file from offset on
+  struct Segment {
+    uint64_t start;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;
+  };
+
+  bool Reopen();  // false with errno, ENOENT if not created yet
+  void Follow(int fd, const struct stat &st, off_t offset);
+  bool Resume();
+  void Drain();
+
+  char path_[1024];
+  char state_[1024];  // empty if none
+  int fd_;
+  int notify_fd_;
+  Log *log_;
+  dev_t dev_;
+  ino_t ino_;
+  off_t offset_;
+  off_t size_;     // of the file, as known at last
+  uint64_t read_;  // bytes given to the pipe
+  deque<Segment> segments_;
+  mutable time_t poll_time_;  // without inotify
+};
+
+// Datagrams, e.g. of syslog, on a UDP port or a unix datagram socket, each
+// one a record ended by '\n' unless it ends so already; a burst is taken
+// with one recvmmsg(2) per read where available, and the datagrams dropped
+// by the kernel for a full receive buffer are counted where SO_RXQ_OVFL is;
+// each one is given room for the largest datagram, 64 KB, so none is cut
+// unless the buffer of the pipe is smaller
+class DatagramSource : public Source {
+ public:
+  DatagramSource();
+  ~DatagramSource();
+
+  // [HOST:]PORT, or a path for a unix datagram socket; a positive rcvbuf
+  // sets SO_RCVBUF, beyond the system limit if privileged
+  bool Bind(const char *address, int rcvbuf);
+
+  int Descriptor() const;
+  ssize_t Read(char *buf, size_t n);
+  size_t Lost() const;
+  size_t Room() const;
+
+ private:
+  int fd_;
+  uint32_t dropped_;   // by the kernel, as SO_RXQ_OVFL tells
+  size_t truncated_;   // longer than the largest one, or the buffer
+};
+
+// Opens an input given as:
+//   fifo:PATH, created if missing and held open for writing too, so the
+//     writers may come and go without an EOF
+//   file:PATH, read once to the end
+//   unix:PATH, see UnixSource
+//   shm:PATH, a ring of 4 MB, see ShmSource
+//   tail:PATH[,STATE], see TailSource
+//   udp:[HOST:]PORT[,RCVBUF] and unixgram:PATH[,RCVBUF], see DatagramSource,
+//     an IPv6 HOST in brackets, e.g. udp:[::1]:514
+//   stdin
+// returns NULL on failure
+Source * OpenSource(const char *spec);
+
+}  // namespace v
+
+#endif  // SOURCE_H_